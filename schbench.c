@@ -19,15 +19,25 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <time.h>
 #include <string.h>
 #include <math.h>
 #include <linux/futex.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 #include <netdb.h>
 
@@ -36,14 +46,107 @@
 #define PLAT_GROUP_NR	19
 #define PLAT_NR		(PLAT_GROUP_NR * PLAT_VAL)
 #define PLAT_LIST_MAX	20
+#define BITS_PER_LONG	(sizeof(unsigned long) * 8)
+#define PLAT_USED_LONGS	((PLAT_NR + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 /* when -p is on, how much do we send back and forth */
 #define PIPE_TRANSFER_BUFFER (1 * 1024 * 1024)
 
 #define USEC_PER_SEC (1000000)
+#define NSEC_PER_SEC (1000000000ULL)
+
+/*
+ * -A controller tuning.  The gains are per second, KI * period is capped
+ * so long sample periods don't overshoot.  We call it converged once
+ * busy stays within AUTO_RPS_BAND of the target for AUTO_RPS_SETTLE
+ * samples in a row
+ */
+#define AUTO_RPS_KP 0.2
+#define AUTO_RPS_KI 0.4
+#define AUTO_RPS_KI_DT_MAX 0.8
+#define AUTO_RPS_MAX_STEP 2.0
+/* below (1 - AUTO_RPS_JUMP_ERR) of the target, jump up to AUTO_RPS_MAX_JUMP */
+#define AUTO_RPS_JUMP_ERR 0.5
+#define AUTO_RPS_MAX_JUMP 8.0
+#define AUTO_RPS_BAND 0.05
+#define AUTO_RPS_SETTLE 4
+/* busy is measured over the last second, up to this many samples */
+#define AUTO_RPS_WINDOW_MAX 64
+
+/*
+ * --slo search limits.  We stop once the pass/fail bracket is within
+ * SLO_PRECISION of the failing RPS.  The first second of each step is
+ * thrown away while the queues settle from the last step.  A step that
+ * completes less than SLO_MIN_ACHIEVED of the requests we dispatched
+ * fails even if the latencies look fine
+ */
+#define SLO_MAX_STEPS 32
+#define SLO_PRECISION 0.02
+#define SLO_SETTLE_SEC 1
+#define SLO_MIN_ACHIEVED 0.95
+
+/* one step of the --slo search, rps numbers are for the whole run */
+struct slo_point {
+	unsigned int rps;
+	double achieved;
+	unsigned int latency;
+	int pass;
+};
+
+static struct slo_point slo_curve[SLO_MAX_STEPS];
+static int nr_slo_points = 0;
+/* index into slo_curve for the highest passing RPS, -1 if none passed */
+static int slo_knee = -1;
+
+/* --worker-spin and --msg-spin adaptive mode never spins longer than this */
+#define SPIN_ADAPTIVE_MAX_NS (50000)
 
 /* -m, number of message threads */
 static int message_threads = 1;
+/* --baseline, the -j output of an earlier run to compare against */
+static char *baseline_file = NULL;
+/* baseline_file escaped for the -j output */
+static char *baseline_json_file = NULL;
+/* --save-histograms, write the raw histograms so -j can be a --baseline */
+static int save_histograms = 0;
+/* --iterations, measurement windows to run in one process */
+static int iterations = 1;
+/* --respawn, stop and start all the threads between iterations */
+static int respawn = 0;
+/* --metrics-socket, unix socket path for live prometheus metrics */
+static char *metrics_socket = NULL;
+/* --flight-recorder, dump recent events around wakeups or requests this slow */
+static unsigned long flight_usec = 0;
+/* --flight-file, where the dumps go */
+static char *flight_file = "schbench-flight.txt";
+static unsigned long flight_dumps = 0;
+static unsigned long flight_dropped = 0;
+/* --phases, file with the load schedule */
+static char *phases_file = NULL;
+/* workers per message thread taking requests, --phases moves this around */
+static int active_workers = 0;
+/* --burst period,requests,window: extra requests on top of -R */
+static double burst_period = 0;
+static unsigned int burst_requests = 0;
+static double burst_window_ms = 0;
+/* --churn period[,mode[,pct]]: change worker affinity every period seconds */
+static double churn_period = 0;
+static int churn_mode = 0;
+static int churn_pct = 50;
+/* --auto-warmup, zero the stats once the numbers stop moving */
+static int auto_warmup = 0;
+/* --steady-pct, how much each number may change between intervals */
+static double steady_pct = 5.0;
+/* --steady-intervals, how many stable intervals in a row we need */
+static int steady_intervals = 3;
+/* --measure, seconds to run after steady state, 0 means until -r */
+static int measure_sec = 0;
+/* how long --auto-warmup took, 0 if we never got there */
+static unsigned long long steady_usec = 0;
+/* --dispatchers, RPS dispatcher threads per message thread */
+static int nr_dispatchers = 1;
+/* --stack-size, 0 means the pthread default */
+static unsigned long stack_size_kb = 0;
 /* -t, number of workers per message thread */
 static int worker_threads = 0;
 /* -r, seconds */
@@ -63,6 +166,16 @@ static unsigned long sleep_usec = 100;
 /* -A, int percentage busy */
 static int auto_rps = 0;
 static int auto_rps_target_hit = 0;
+/* --auto-rps-period, ms between -A controller samples */
+static int auto_rps_period_ms = 250;
+/* --auto-rps-cpus, only count the -W CPUs as busy or idle */
+static int auto_rps_cpus = 0;
+/* --slo, search for the highest RPS that keeps request latency under this */
+static unsigned int slo_usec = 0;
+/* --slo-pct, the request latency percentile checked against --slo */
+static double slo_pct = 99.0;
+/* --slo-step, seconds spent at each RPS during the search */
+static int slo_step_sec = 5;
 /* -p, bytes */
 static int pipe_test = 0;
 /* -R, requests per sec */
@@ -79,6 +192,59 @@ static char *jobname = NULL;
 static int split_percent = 0;
 static int split_specified = 0;
 
+/* --wake-mode, how the message thread gets its workers going again */
+enum {
+	WAKE_LOOP = 0,		/* one FUTEX_WAKE per worker */
+	WAKE_SHARED,		/* one FUTEX_WAKE on a per-group futex word */
+	WAKE_WAITV,		/* futex_waitv on the worker and group words */
+	WAKE_PERCPU,		/* at most one wakeup per CPU each pass */
+	WAKE_HELPER,		/* hand wakeups to a per-LLC helper thread */
+};
+static int wake_mode = WAKE_LOOP;
+static int wake_mode_specified = 0;
+static char *wake_mode_names[] = { "loop", "shared", "waitv", "percpu",
+				   "helper", NULL };
+
+/*
+ * --worker-spin and --msg-spin, how long to spin on the futex before
+ * we go to sleep in the kernel.  Adaptive mode spins for about as long
+ * as recent waits have taken, capped at max_ns
+ */
+struct spin_policy {
+	unsigned long long ns;
+	unsigned long long max_ns;
+	int adaptive;
+};
+static struct spin_policy worker_spin = { 0 };
+static struct spin_policy msg_spin = { 0 };
+
+/* --kernel, what the workers do with their cache footprint */
+enum {
+	KERNEL_MATRIX = 0,	/* naive matrix multiply */
+	KERNEL_COPY,		/* STREAM copy, c = a */
+	KERNEL_SCALE,		/* STREAM scale, b = k * c */
+	KERNEL_TRIAD,		/* STREAM triad, a = b + k * c */
+};
+static int work_kernel = KERNEL_MATRIX;
+static char *work_kernel_names[] = { "matrix", "copy", "scale", "triad", NULL };
+
+/* --hugepages, how we back the worker matrices and shared_data */
+enum {
+	PAGES_DEFAULT = 0,	/* plain malloc, THP if we get lucky */
+	PAGES_THP,		/* mmap + MADV_HUGEPAGE */
+	PAGES_2M,		/* MAP_HUGETLB, 2MB pages */
+	PAGES_1G,		/* MAP_HUGETLB, 1GB pages */
+	PAGES_4K,		/* mmap + MADV_NOHUGEPAGE */
+};
+static int page_backing = PAGES_DEFAULT;
+static char *page_backing_names[] = { "default", "thp", "2M", "1G", "4k", NULL };
+/* how many MAP_HUGETLB allocations had to fall back to normal pages */
+static unsigned long hugetlb_fallbacks = 0;
+/* what the first worker matrix ended up with, from /proc/self/smaps */
+static char worker_backing[128] = "";
+/* same for shared_data */
+static char shared_backing[128] = "";
+
 /* the message threads flip this to true when they decide runtime is up */
 static volatile unsigned long stopping = 0;
 
@@ -103,6 +269,97 @@ static cpu_set_t __message_cpus = { 0 };
 static cpu_set_t *worker_cpus = NULL;
 static cpu_set_t __worker_cpus = { 0 };
 
+/* CPU layout, filled in by read_cpu_topology() */
+struct cpu_topo {
+	/* the first SMT sibling of the core this CPU is on */
+	int core;
+	int llc;
+	int package;
+	int node;
+};
+static struct cpu_topo *cpu_topo = NULL;
+static int nr_llc = 0;
+static cpu_set_t *llc_cpus = NULL;
+
+/* --wakeup-topology, where the wakee ran relative to the waker */
+enum {
+	DIST_SAME_CPU = 0,
+	DIST_SMT,
+	DIST_LLC,
+	DIST_NODE,
+	DIST_REMOTE,
+	NR_DIST,
+};
+static int wakeup_topology = 0;
+
+/* --breakdown, where the time in each request went */
+enum {
+	BD_QUEUE = 0,	/* dispatched until a worker picked it up */
+	BD_SLEEP,
+	BD_LOCK,	/* waiting for the per-cpu lock */
+	BD_COMPUTE,
+	BD_E2E,		/* dispatched until done */
+	NR_BREAKDOWN,
+};
+static int breakdown = 0;
+
+/* --fairness, per-worker results so starved workers don't hide in the totals */
+static int fairness = 0;
+
+/* --pin, topology aware placement built on read_cpu_topology() */
+enum {
+	PIN_NONE = 0,
+	PIN_LLC,	/* one message group per LLC, workers confined there */
+	PIN_SPREAD,	/* one CPU per thread, spread across LLCs and nodes */
+	PIN_COMPACT,	/* one CPU per thread, packed together */
+};
+static int pin_policy = PIN_NONE;
+static char *pin_policy_names[] = { "none", "llc", "spread", "compact", NULL };
+/* --no-smt, only use one CPU from each core */
+static int pin_no_smt = 0;
+static int message_threads_specified = 0;
+
+/* --sleep-mode, how workers do the simulated networking sleep */
+enum {
+	SLEEP_USLEEP = 0,
+	SLEEP_NANOSLEEP,
+	SLEEP_ABS,		/* clock_nanosleep with an absolute deadline */
+	SLEEP_TIMERFD,
+	SLEEP_EPOLL,		/* epoll_pwait2 timeout on an empty epoll set */
+	SLEEP_FUTEX,		/* FUTEX_WAIT timeout on a futex nobody posts */
+};
+static int sleep_mode = SLEEP_USLEEP;
+/* the oversleep histogram is only kept when --sleep-mode is given */
+static int sleep_mode_specified = 0;
+static char *sleep_mode_names[] = { "usleep", "nanosleep", "abs", "timerfd",
+				    "epoll", "futex", NULL };
+/* --pacing, how the RPS dispatcher spreads requests over each second */
+enum {
+	PACE_BURST = 0,		/* the whole second's worth at once */
+	PACE_UNIFORM,
+	PACE_POISSON,		/* exponential inter-arrival times */
+};
+static int pacing = PACE_BURST;
+static char *pacing_names[] = { "burst", "uniform", "poisson", NULL };
+
+/*
+ * paced dispatch doesn't bother sleeping for gaps shorter than this,
+ * timer wakeups aren't accurate enough.  Requests due that soon go out
+ * in a batch with the current one
+ */
+#define PACE_MIN_SLEEP_NS 50000
+
+/* --timerslack, ns for PR_SET_TIMERSLACK in the workers, -1 leaves it alone */
+static long timerslack_ns = -1;
+static char *dist_names[] = { "same cpu", "smt sibling", "same llc",
+			      "same node", "remote node" };
+static char *dist_json_names[] = { "same_cpu", "smt", "llc", "node",
+				   "remote" };
+static char *breakdown_names[] = { "queue wait", "sleep", "lock wait",
+				   "compute", "end to end" };
+static char *breakdown_json_names[] = { "queue_wait", "sleep", "lock_wait",
+					"compute", "end_to_end" };
+
 /*
  * one stat struct per thread data, when the workers sleep this records the
  * latency between when they are woken up and when they actually get the
@@ -110,14 +367,80 @@ static cpu_set_t __worker_cpus = { 0 };
  * then bubble them up to main() for printing
  */
 struct stats {
+	/*
+	 * one bit per non-zero plat bucket so combine_stats() only has to
+	 * look at the buckets that are in use.  Stats that add_lat() might
+	 * be writing get zeroed with reset_stats(), which clears this
+	 * before plat
+	 */
+	unsigned long used[PLAT_USED_LONGS];
 	unsigned int plat[PLAT_NR];
 	unsigned long nr_samples;
 	unsigned int max;
 	unsigned int min;
 };
 
+/*
+ * one worker's, or one group's, loops and latencies summed over every
+ * iteration.  fair_workers is indexed by group * worker_threads + worker
+ */
+struct fair_stats {
+	unsigned long long loops;
+	struct stats wakeup;
+	struct stats request;
+};
+static struct fair_stats *fair_workers = NULL;
+static struct fair_stats *fair_groups = NULL;
+
 struct stats rps_stats;
 
+/* one RPS dispatcher, each message thread has --dispatchers of these */
+struct dispatcher {
+	pthread_t tid;
+	clockid_t cpu_clock;
+	/* which dispatcher we are overall, seeds --pacing poisson */
+	int index;
+	/* our shard of the group's workers, first is the offset in the group */
+	struct thread_data *workers;
+	int first;
+	int nr_workers;
+	int cur_tid;
+
+	unsigned long long sent;
+	/* requests we skipped because the worker was backed up */
+	unsigned long long dropped;
+	/* times we couldn't keep up with our share of the RPS */
+	unsigned long long overruns;
+	/* how late --pacing sent each request */
+	struct stats lateness;
+
+	/* start_ns is set once cpu_clock is valid, the rest when we stop */
+	unsigned long long start_ns;
+	unsigned long long cpu_ns;
+	unsigned long long wall_ns;
+
+	/* reporter side, for cpu use over each interval */
+	unsigned long long last_cpu_ns;
+	unsigned long long last_ns;
+};
+
+/*
+ * a dispatcher using more cpu than this is probably what's limiting
+ * the RPS, not the scheduler
+ */
+#define DISPATCH_SATURATED_PCT 90
+
+/* the reporter's own cpu use is only printed once it's this high */
+#define REPORTER_WARN_PCT 1.0
+
+/* message_threads * nr_dispatchers of these for -R */
+static struct dispatcher *dispatchers = NULL;
+/*
+ * with a single dispatcher that kept up there's nothing to say, the
+ * dispatcher report is only printed and written to json when this is set
+ */
+static int report_dispatchers = 0;
+
 /* this defines which latency profiles get printed */
 #define PLIST_20 (1 << 0)
 #define PLIST_50 (1 << 1)
@@ -129,10 +452,48 @@ struct stats rps_stats;
 #define PLIST_FOR_LAT (PLIST_50 | PLIST_90 | PLIST_99 | PLIST_999)
 #define PLIST_FOR_RPS (PLIST_20 | PLIST_50 | PLIST_90)
 
+/* --wake-mode batch position histograms */
+#define WAKE_POS_BUCKETS 8
+
 static double plist[PLAT_LIST_MAX] = { 20.0, 50.0, 90.0, 99.0, 99.9 };
 
 enum {
 	HELP_LONG_OPT = 1,
+	WAKE_MODE_OPT,
+	WORKER_SPIN_OPT,
+	MSG_SPIN_OPT,
+	KERNEL_OPT,
+	HUGEPAGES_OPT,
+	WAKEUP_TOPOLOGY_OPT,
+	BREAKDOWN_OPT,
+	FAIRNESS_OPT,
+	FLIGHT_RECORDER_OPT,
+	FLIGHT_FILE_OPT,
+	PIN_OPT,
+	NO_SMT_OPT,
+	SLEEP_MODE_OPT,
+	TIMERSLACK_OPT,
+	AUTO_RPS_PERIOD_OPT,
+	AUTO_RPS_CPUS_OPT,
+	SLO_OPT,
+	SLO_PCT_OPT,
+	SLO_STEP_OPT,
+	PACING_OPT,
+	DISPATCHERS_OPT,
+	STACK_SIZE_OPT,
+	AUTO_WARMUP_OPT,
+	STEADY_PCT_OPT,
+	STEADY_INTERVALS_OPT,
+	MEASURE_OPT,
+	BASELINE_OPT,
+	SAVE_HISTOGRAMS_OPT,
+	ITERATIONS_OPT,
+	RESPAWN_OPT,
+	METRICS_SOCKET_OPT,
+	PHASES_OPT,
+	BURST_OPT,
+	CHURN_OPT,
+	ANTAGONIST_OPT,
 };
 
 char *option_string = "p:m:M:W:t:Cr:R:w:i:z:A:n:F:Lj:s:J:";
@@ -156,10 +517,214 @@ static struct option long_options[] = {
 	{"json", required_argument, 0, 'j'},
 	{"jobname", required_argument, 0, 'J'},
 	{"split", required_argument, 0, 'S'},
+	{"wake-mode", required_argument, 0, WAKE_MODE_OPT},
+	{"worker-spin", required_argument, 0, WORKER_SPIN_OPT},
+	{"msg-spin", required_argument, 0, MSG_SPIN_OPT},
+	{"kernel", required_argument, 0, KERNEL_OPT},
+	{"hugepages", required_argument, 0, HUGEPAGES_OPT},
+	{"wakeup-topology", no_argument, 0, WAKEUP_TOPOLOGY_OPT},
+	{"breakdown", no_argument, 0, BREAKDOWN_OPT},
+	{"fairness", no_argument, 0, FAIRNESS_OPT},
+	{"flight-recorder", required_argument, 0, FLIGHT_RECORDER_OPT},
+	{"flight-file", required_argument, 0, FLIGHT_FILE_OPT},
+	{"pin", required_argument, 0, PIN_OPT},
+	{"no-smt", no_argument, 0, NO_SMT_OPT},
+	{"sleep-mode", required_argument, 0, SLEEP_MODE_OPT},
+	{"timerslack", required_argument, 0, TIMERSLACK_OPT},
+	{"auto-rps-period", required_argument, 0, AUTO_RPS_PERIOD_OPT},
+	{"auto-rps-cpus", no_argument, 0, AUTO_RPS_CPUS_OPT},
+	{"slo", required_argument, 0, SLO_OPT},
+	{"slo-pct", required_argument, 0, SLO_PCT_OPT},
+	{"slo-step", required_argument, 0, SLO_STEP_OPT},
+	{"pacing", required_argument, 0, PACING_OPT},
+	{"dispatchers", required_argument, 0, DISPATCHERS_OPT},
+	{"stack-size", required_argument, 0, STACK_SIZE_OPT},
+	{"auto-warmup", no_argument, 0, AUTO_WARMUP_OPT},
+	{"steady-pct", required_argument, 0, STEADY_PCT_OPT},
+	{"steady-intervals", required_argument, 0, STEADY_INTERVALS_OPT},
+	{"measure", required_argument, 0, MEASURE_OPT},
+	{"baseline", required_argument, 0, BASELINE_OPT},
+	{"save-histograms", no_argument, 0, SAVE_HISTOGRAMS_OPT},
+	{"iterations", required_argument, 0, ITERATIONS_OPT},
+	{"respawn", no_argument, 0, RESPAWN_OPT},
+	{"metrics-socket", required_argument, 0, METRICS_SOCKET_OPT},
+	{"phases", required_argument, 0, PHASES_OPT},
+	{"burst", required_argument, 0, BURST_OPT},
+	{"churn", required_argument, 0, CHURN_OPT},
+	{"antagonist", required_argument, 0, ANTAGONIST_OPT},
 	{"help", no_argument, 0, HELP_LONG_OPT},
 	{0, 0, 0, 0}
 };
 
+/* how --churn moves the workers around */
+enum {
+	CHURN_RESIZE = 0,
+	CHURN_SHUFFLE,
+};
+static char *churn_names[] = { "resize", "shuffle", NULL };
+
+static void parse_churn(char *arg)
+{
+	char *mode;
+	char *pct;
+	int i;
+
+	mode = strchr(arg, ',');
+	if (mode)
+		*mode++ = '\0';
+	churn_period = atof(arg);
+	if (churn_period < 2) {
+		fprintf(stderr, "--churn period must be at least 2 seconds\n");
+		exit(1);
+	}
+	if (!mode)
+		return;
+
+	pct = strchr(mode, ',');
+	if (pct)
+		*pct++ = '\0';
+	for (i = 0; churn_names[i]; i++) {
+		if (!strcmp(mode, churn_names[i]))
+			break;
+	}
+	if (!churn_names[i]) {
+		fprintf(stderr, "unknown churn mode %s\n", mode);
+		exit(1);
+	}
+	churn_mode = i;
+	if (pct) {
+		churn_pct = atoi(pct);
+		if (churn_pct < 1 || churn_pct > 100) {
+			fprintf(stderr, "--churn pct must be between 1 and 100\n");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * --antagonist, batch style noise running next to the message and worker
+ * threads.  Each one is count threads of the same type, all of them
+ * counting how much work they got done
+ */
+enum {
+	ANTAG_CPU = 0,
+	ANTAG_MEM,
+	ANTAG_CACHE,
+	ANTAG_SPAWN,
+};
+static char *antag_names[] = { "cpu", "mem", "cache", "spawn", NULL };
+static char *antag_units[] = { "Mops/s", "MB/s", "MB/s", "threads/s" };
+
+#define MAX_ANTAGONISTS 8
+
+struct antag_thread {
+	struct antagonist *antag;
+	pthread_t tid;
+	unsigned long long ops;
+	unsigned long seed;
+	char *buf;
+};
+
+struct antagonist {
+	int type;
+	int count;
+	int policy;
+	int nice;
+	size_t bytes;
+	volatile int stop;
+	unsigned long long start_ns;
+
+	/* totals over every run, and the same threads running alone */
+	unsigned long long ops;
+	unsigned long long run_ns;
+	double solo_rate;
+
+	struct antag_thread *threads;
+};
+
+static struct antagonist antagonists[MAX_ANTAGONISTS];
+static int nr_antagonists = 0;
+
+static void parse_antagonist(char *arg)
+{
+	struct antagonist *a;
+	char *count;
+	char *policy;
+	char *end;
+	int i;
+
+	if (nr_antagonists == MAX_ANTAGONISTS) {
+		fprintf(stderr, "at most %d --antagonist options are allowed\n",
+			MAX_ANTAGONISTS);
+		exit(1);
+	}
+	a = antagonists + nr_antagonists;
+	a->policy = SCHED_OTHER;
+
+	count = strchr(arg, ':');
+	if (count)
+		*count++ = '\0';
+	for (i = 0; antag_names[i]; i++) {
+		if (!strcmp(arg, antag_names[i]))
+			break;
+	}
+	if (!antag_names[i]) {
+		fprintf(stderr, "unknown antagonist type %s\n", arg);
+		exit(1);
+	}
+	a->type = i;
+
+	a->count = 1;
+	if (count) {
+		policy = strchr(count, ':');
+		if (policy)
+			*policy++ = '\0';
+		a->count = atoi(count);
+		if (a->count < 1) {
+			fprintf(stderr, "--antagonist needs at least one thread\n");
+			exit(1);
+		}
+		if (!policy)
+			goto out;
+		if (!strcmp(policy, "batch")) {
+			a->policy = SCHED_BATCH;
+		} else if (!strcmp(policy, "idle")) {
+			a->policy = SCHED_IDLE;
+		} else {
+			a->nice = strtol(policy, &end, 10);
+			if (*end || end == policy || a->nice < -20 || a->nice > 19) {
+				fprintf(stderr, "--antagonist policy must be batch, idle or a nice value\n");
+				exit(1);
+			}
+		}
+	}
+out:
+	nr_antagonists++;
+}
+
+static char *antag_policy_name(struct antagonist *a)
+{
+	if (a->policy == SCHED_BATCH)
+		return "batch";
+	if (a->policy == SCHED_IDLE)
+		return "idle";
+	return "normal";
+}
+
+/* ops per second, scaled to whatever antag_units says */
+static double antag_rate(unsigned long long ops, unsigned long long ns,
+			 int type)
+{
+	double rate;
+
+	if (!ns)
+		return 0;
+	rate = (double)ops * NSEC_PER_SEC / ns;
+	if (type == ANTAG_CPU || type == ANTAG_MEM || type == ANTAG_CACHE)
+		rate /= 1024 * 1024;
+	return rate;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr, "schbench usage:\n"
@@ -182,6 +747,41 @@ static void print_usage(void)
 		"\t-j (--json) <file>: output in json format (def: false)\n"
 		"\t-J (--jobname) <name>: an optional jobname to add to the json output (def: none)\n"
 		"\t--split <percent>: percent of cache footprint that is private per thread (0-100, def: all private)\n"
+		"\t--wake-mode <mode>: loop, shared, waitv, percpu or helper (def: loop)\n"
+		"\t--worker-spin <ns|adaptive[:max_ns]>: spin before workers sleep (def: 0)\n"
+		"\t--msg-spin <ns|adaptive[:max_ns]>: spin before message threads sleep (def: 0)\n"
+		"\t--kernel <kernel>: matrix, copy, scale or triad (def: matrix)\n"
+		"\t--hugepages <type>: back matrices with default, thp, 2M, 1G or 4k pages (def: default)\n"
+		"\t--wakeup-topology: break down wakeup latency by waker/wakee CPU distance\n"
+		"\t--breakdown: split request latency into queue wait, sleep, lock wait and compute\n"
+		"\t--fairness: report per-worker loops and latencies, and how evenly they are spread\n"
+		"\t--flight-recorder <usec>: dump recent events around wakeups or requests slower than usec\n"
+		"\t--flight-file <path>: where --flight-recorder writes (def: schbench-flight.txt)\n"
+		"\t--pin <policy>: topology pinning, llc, spread or compact (def: none)\n"
+		"\t--no-smt: with --pin, only use one CPU from each core\n"
+		"\t--sleep-mode <mode>: usleep, nanosleep, abs, timerfd, epoll or futex (def: usleep)\n"
+		"\t--timerslack <ns>: PR_SET_TIMERSLACK for worker threads (def: unchanged)\n"
+		"\t--auto-rps-period <ms>: how often -A samples cpu utilization (def: 250)\n"
+		"\t--auto-rps-cpus: -A only looks at utilization of the -W cpus\n"
+		"\t--slo <usec>: search for the max RPS with request latency under usec\n"
+		"\t--slo-pct <pct>: request latency percentile for --slo (def: 99)\n"
+		"\t--slo-step <sec>: seconds at each RPS during --slo (def: 5)\n"
+		"\t--pacing <mode>: -R dispatch: burst|uniform|poisson (def: burst)\n"
+		"\t--dispatchers <count>: -R dispatch threads per message thread (def: 1)\n"
+		"\t--stack-size <KB>: stack size for all our threads (def: libc default)\n"
+		"\t--auto-warmup: zero stats once rps and latencies settle, instead of -w\n"
+		"\t--steady-pct <pct>: max change per interval for --auto-warmup (def: 5)\n"
+		"\t--steady-intervals <count>: stable intervals in a row for --auto-warmup (def: 3)\n"
+		"\t--measure <sec>: with --auto-warmup, run this long after steady state (def: until -r)\n"
+		"\t--baseline <file>: compare this run against an earlier -j file\n"
+		"\t--save-histograms: add the raw histograms to -j, so it can be a --baseline\n"
+		"\t--iterations <count>: measure this many times in one run (def: 1)\n"
+		"\t--respawn: restart all the threads between --iterations\n"
+		"\t--metrics-socket <path>: serve live prometheus metrics on this unix socket\n"
+		"\t--phases <file>: change rps, threads, ops and sleep over time from this file\n"
+		"\t--burst <sec,count,msec>: with -R, every sec seconds add count requests over msec\n"
+		"\t--churn <sec[,resize|shuffle[,pct]]>: change worker affinity every sec seconds (def: resize,50)\n"
+		"\t--antagonist <type:count[:policy]>: run cpu|mem|cache|spawn hogs at nice N, batch or idle\n"
 	       );
 	exit(1);
 }
@@ -238,6 +838,33 @@ int parse_cpuset(const char *str, cpu_set_t *cpuset)
 	return 1;
 }
 
+/*
+ * --worker-spin and --msg-spin take either a fixed number of nanoseconds
+ * or adaptive, with an optional cap.  Returns 0 if we fail to parse
+ */
+static int parse_spin(const char *str, struct spin_policy *policy)
+{
+	char *endptr;
+
+	memset(policy, 0, sizeof(*policy));
+	if (!strncmp(str, "adaptive", 8)) {
+		policy->adaptive = 1;
+		policy->max_ns = SPIN_ADAPTIVE_MAX_NS;
+		str += 8;
+		if (*str == '\0')
+			return 1;
+		if (*str != ':')
+			return 0;
+		str++;
+		errno = 0;
+		policy->max_ns = strtoull(str, &endptr, 10);
+		return !errno && *endptr == '\0';
+	}
+	errno = 0;
+	policy->ns = strtoull(str, &endptr, 10);
+	return !errno && *str && *endptr == '\0';
+}
+
 /*
  * -M and -W can take "auto", which means:
  *  give each message thread its own CPU
@@ -258,9 +885,37 @@ static void thread_auto_pin(int m_threads, cpu_set_t *m_cpus,
 	fprintf(stderr, "auto pinning message and worker threads\n");
 }
 
+static char *escape_string(char *str)
+{
+	int len = strlen(str);
+	int maxlen = len * 2;
+	char *newstr = malloc(len * 2 + 1);
+	char *ptr = newstr;
+
+	if (!newstr) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(newstr, str, len);
+	newstr[len] = '\0';
+	while ((ptr = strpbrk(ptr, "\"\\"))) {
+		if (len >= maxlen) {
+			free(newstr);
+			return NULL;
+		}
+		/* shift the tail, nul included, over by one */
+		memmove(ptr + 1, ptr, len - (ptr - newstr) + 1);
+		*ptr = '\\';
+		ptr += 2;
+		len++;
+	}
+	return newstr;
+}
+
 static void parse_options(int ac, char **av)
 {
 	int c;
+	int i;
 	int found_warmuptime = -1;
 	int found_auto_pin = 0;
 
@@ -300,6 +955,7 @@ static void parse_options(int ac, char **av)
 			break;
 		case 'm':
 			message_threads = atoi(optarg);
+			message_threads_specified = 1;
 			break;
 		case 'M':
 			if (!strcmp(optarg, "auto")) {
@@ -365,6 +1021,228 @@ static void parse_options(int ac, char **av)
 			}
 			split_specified = 1;
 			break;
+		case WAKE_MODE_OPT:
+			for (i = 0; wake_mode_names[i]; i++) {
+				if (!strcmp(optarg, wake_mode_names[i]))
+					break;
+			}
+			if (!wake_mode_names[i]) {
+				fprintf(stderr, "unknown wake mode %s\n", optarg);
+				exit(1);
+			}
+			wake_mode = i;
+			wake_mode_specified = 1;
+			break;
+		case KERNEL_OPT:
+			for (i = 0; work_kernel_names[i]; i++) {
+				if (!strcmp(optarg, work_kernel_names[i]))
+					break;
+			}
+			if (!work_kernel_names[i]) {
+				fprintf(stderr, "unknown kernel %s\n", optarg);
+				exit(1);
+			}
+			work_kernel = i;
+			break;
+		case HUGEPAGES_OPT:
+			for (i = 0; page_backing_names[i]; i++) {
+				if (!strcmp(optarg, page_backing_names[i]))
+					break;
+			}
+			if (!page_backing_names[i]) {
+				fprintf(stderr, "unknown hugepage type %s\n", optarg);
+				exit(1);
+			}
+			page_backing = i;
+			break;
+		case WAKEUP_TOPOLOGY_OPT:
+			wakeup_topology = 1;
+			break;
+		case BREAKDOWN_OPT:
+			breakdown = 1;
+			break;
+		case FAIRNESS_OPT:
+			fairness = 1;
+			break;
+		case FLIGHT_RECORDER_OPT:
+			flight_usec = atol(optarg);
+			if (!flight_usec) {
+				fprintf(stderr, "--flight-recorder needs a threshold in usec\n");
+				exit(1);
+			}
+			break;
+		case FLIGHT_FILE_OPT:
+			flight_file = optarg;
+			break;
+		case PIN_OPT:
+			for (i = 0; pin_policy_names[i]; i++) {
+				if (!strcmp(optarg, pin_policy_names[i]))
+					break;
+			}
+			if (!pin_policy_names[i]) {
+				fprintf(stderr, "unknown pin policy %s\n", optarg);
+				exit(1);
+			}
+			pin_policy = i;
+			break;
+		case NO_SMT_OPT:
+			pin_no_smt = 1;
+			break;
+		case SLEEP_MODE_OPT:
+			for (i = 0; sleep_mode_names[i]; i++) {
+				if (!strcmp(optarg, sleep_mode_names[i]))
+					break;
+			}
+			if (!sleep_mode_names[i]) {
+				fprintf(stderr, "unknown sleep mode %s\n", optarg);
+				exit(1);
+			}
+			sleep_mode = i;
+			sleep_mode_specified = 1;
+			break;
+		case PACING_OPT:
+			for (i = 0; pacing_names[i]; i++) {
+				if (!strcmp(optarg, pacing_names[i]))
+					break;
+			}
+			if (!pacing_names[i]) {
+				fprintf(stderr, "unknown pacing %s\n", optarg);
+				exit(1);
+			}
+			pacing = i;
+			break;
+		case BASELINE_OPT:
+			baseline_file = optarg;
+			baseline_json_file = escape_string(optarg);
+			if (!baseline_json_file) {
+				fprintf(stderr, "escape_string failed\n");
+				exit(1);
+			}
+			break;
+		case SAVE_HISTOGRAMS_OPT:
+			save_histograms = 1;
+			break;
+		case ITERATIONS_OPT:
+			iterations = atoi(optarg);
+			if (iterations < 1) {
+				fprintf(stderr, "--iterations must be at least 1\n");
+				exit(1);
+			}
+			break;
+		case RESPAWN_OPT:
+			respawn = 1;
+			break;
+		case METRICS_SOCKET_OPT:
+			metrics_socket = optarg;
+			break;
+		case PHASES_OPT:
+			phases_file = optarg;
+			break;
+		case CHURN_OPT:
+			parse_churn(optarg);
+			break;
+		case ANTAGONIST_OPT:
+			parse_antagonist(optarg);
+			break;
+		case BURST_OPT:
+			if (sscanf(optarg, "%lf,%u,%lf", &burst_period,
+				   &burst_requests, &burst_window_ms) != 3 ||
+			    burst_period < 2 || !burst_requests ||
+			    burst_window_ms < 0 ||
+			    burst_window_ms >= (burst_period - 1) * 1000) {
+				fprintf(stderr, "--burst wants period,requests,window_ms with a period of at least 2 seconds and a window shorter than period - 1\n");
+				exit(1);
+			}
+			break;
+		case AUTO_WARMUP_OPT:
+			auto_warmup = 1;
+			break;
+		case STEADY_PCT_OPT:
+			steady_pct = atof(optarg);
+			if (steady_pct <= 0) {
+				fprintf(stderr, "steady pct must be positive\n");
+				exit(1);
+			}
+			break;
+		case STEADY_INTERVALS_OPT:
+			steady_intervals = atoi(optarg);
+			if (steady_intervals < 1) {
+				fprintf(stderr, "need at least one steady interval\n");
+				exit(1);
+			}
+			break;
+		case MEASURE_OPT:
+			measure_sec = atoi(optarg);
+			if (measure_sec < 1) {
+				fprintf(stderr, "measure time must be positive\n");
+				exit(1);
+			}
+			break;
+		case STACK_SIZE_OPT:
+			stack_size_kb = atol(optarg);
+			if (stack_size_kb == 0) {
+				fprintf(stderr, "stack size must be positive\n");
+				exit(1);
+			}
+			break;
+		case DISPATCHERS_OPT:
+			nr_dispatchers = atoi(optarg);
+			if (nr_dispatchers < 1) {
+				fprintf(stderr, "need at least one dispatcher\n");
+				exit(1);
+			}
+			break;
+		case AUTO_RPS_PERIOD_OPT:
+			auto_rps_period_ms = atoi(optarg);
+			if (auto_rps_period_ms <= 0) {
+				fprintf(stderr, "auto rps period must be positive\n");
+				exit(1);
+			}
+			break;
+		case AUTO_RPS_CPUS_OPT:
+			auto_rps_cpus = 1;
+			break;
+		case SLO_OPT:
+			slo_usec = atoi(optarg);
+			if (slo_usec == 0) {
+				fprintf(stderr, "slo must be positive\n");
+				exit(1);
+			}
+			break;
+		case SLO_PCT_OPT:
+			slo_pct = atof(optarg);
+			if (slo_pct <= 0 || slo_pct > 100) {
+				fprintf(stderr, "slo percentile must be in (0, 100]\n");
+				exit(1);
+			}
+			break;
+		case SLO_STEP_OPT:
+			slo_step_sec = atoi(optarg);
+			if (slo_step_sec <= SLO_SETTLE_SEC) {
+				fprintf(stderr, "slo step must be more than %d seconds\n",
+					SLO_SETTLE_SEC);
+				exit(1);
+			}
+			break;
+		case TIMERSLACK_OPT:
+			timerslack_ns = atol(optarg);
+			if (timerslack_ns < 0) {
+				fprintf(stderr, "timerslack must be positive\n");
+				exit(1);
+			}
+			break;
+		case WORKER_SPIN_OPT:
+			if (!parse_spin(optarg, &worker_spin)) {
+				fprintf(stderr, "failed to parse worker spin %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case MSG_SPIN_OPT:
+			if (!parse_spin(optarg, &msg_spin)) {
+				fprintf(stderr, "failed to parse msg spin %s\n", optarg);
+				exit(1);
+			}
+			break;
 		case '?':
 		case HELP_LONG_OPT:
 			print_usage();
@@ -392,35 +1270,83 @@ static void parse_options(int ac, char **av)
 	if (runtime < 30)
 		warmuptime = 0;
 
-	if (optind < ac) {
-		fprintf(stderr, "Error Extra arguments '%s'\n", av[optind]);
+	if (churn_period && (pipe_test || slo_usec)) {
+		fprintf(stderr, "--churn can't be combined with -p or --slo\n");
 		exit(1);
 	}
-}
 
-void tvsub(struct timeval * tdiff, struct timeval * t1, struct timeval * t0)
-{
-	tdiff->tv_sec = t1->tv_sec - t0->tv_sec;
-	tdiff->tv_usec = t1->tv_usec - t0->tv_usec;
-	if (tdiff->tv_usec < 0 && tdiff->tv_sec > 0) {
-		tdiff->tv_sec--;
-		tdiff->tv_usec += USEC_PER_SEC;
-		if (tdiff->tv_usec < 0) {
-			fprintf(stderr, "lat_fs: tvsub shows test time ran backwards!\n");
-			exit(1);
-		}
+	/* both of them track recovery through the workers' peak_pending */
+	if (churn_period && burst_period) {
+		fprintf(stderr, "--churn can't be combined with --burst\n");
+		exit(1);
 	}
 
-	/* time shouldn't go backwards!!! */
-	if (tdiff->tv_usec < 0 || t1->tv_sec < t0->tv_sec) {
-		tdiff->tv_sec = 0;
-		tdiff->tv_usec = 0;
+	if (burst_period && (pipe_test || slo_usec)) {
+		fprintf(stderr, "--burst can't be combined with -p or --slo\n");
+		exit(1);
 	}
-}
 
-/*
- * returns the difference between start and stop in usecs.  Negative values
- * are turned into 0
+	if (phases_file) {
+		if (auto_rps || pipe_test || slo_usec || auto_warmup ||
+		    iterations > 1) {
+			fprintf(stderr, "--phases can't be combined with -A, -p, --slo, --auto-warmup or --iterations\n");
+			exit(1);
+		}
+		warmuptime = 0;
+	}
+
+	if (auto_warmup) {
+		if (pipe_test || slo_usec) {
+			fprintf(stderr, "--auto-warmup can't be combined with -p or --slo\n");
+			exit(1);
+		}
+		warmuptime = 0;
+	}
+
+	if (slo_usec) {
+		if (auto_rps || pipe_test) {
+			fprintf(stderr, "--slo can't be combined with -A or -p\n");
+			exit(1);
+		}
+		if (iterations > 1) {
+			fprintf(stderr, "--slo can't be combined with --iterations\n");
+			exit(1);
+		}
+		/* -R is where the search starts */
+		if (requests_per_sec == 0)
+			requests_per_sec = 100;
+		warmuptime = 0;
+	}
+
+	if (optind < ac) {
+		fprintf(stderr, "Error Extra arguments '%s'\n", av[optind]);
+		exit(1);
+	}
+}
+
+void tvsub(struct timeval * tdiff, struct timeval * t1, struct timeval * t0)
+{
+	tdiff->tv_sec = t1->tv_sec - t0->tv_sec;
+	tdiff->tv_usec = t1->tv_usec - t0->tv_usec;
+	if (tdiff->tv_usec < 0 && tdiff->tv_sec > 0) {
+		tdiff->tv_sec--;
+		tdiff->tv_usec += USEC_PER_SEC;
+		if (tdiff->tv_usec < 0) {
+			fprintf(stderr, "lat_fs: tvsub shows test time ran backwards!\n");
+			exit(1);
+		}
+	}
+
+	/* time shouldn't go backwards!!! */
+	if (tdiff->tv_usec < 0 || t1->tv_sec < t0->tv_sec) {
+		tdiff->tv_sec = 0;
+		tdiff->tv_usec = 0;
+	}
+}
+
+/*
+ * returns the difference between start and stop in usecs.  Negative values
+ * are turned into 0
  */
 unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
 {
@@ -434,6 +1360,24 @@ unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
 	return (usecs);
 }
 
+/* monotonic clock in nanoseconds, for things gtod is too coarse for */
+static unsigned long long nsec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct timespec ns_to_timespec(unsigned long long ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	return ts;
+}
+
 /* mr axboe's magic latency histogram */
 static unsigned int plat_val_to_idx(unsigned int val)
 {
@@ -549,6 +1493,22 @@ static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
 	return len;
 }
 
+/* the value at percentile pct of s, or 0 if there are no samples */
+static unsigned int stats_percentile(struct stats *s, double pct)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	if (!s->nr_samples)
+		return 0;
+	for (i = 0; i < PLAT_NR; i++) {
+		sum += s->plat[i];
+		if (sum >= pct / 100.0 * s->nr_samples)
+			return plat_idx_to_val(i);
+	}
+	return s->max;
+}
+
 static void show_latencies(struct stats *s, char *label, char *units,
 			   unsigned long long runtime, unsigned long mask,
 			   unsigned long star)
@@ -579,30 +1539,83 @@ static void show_latencies(struct stats *s, char *label, char *units,
 	fprintf(stderr, "\t  min=%u, max=%u\n", s->min, s->max);
 }
 
-static char *escape_string(char *str)
+/* bucket batch positions by powers of two: 0, 1, 2-3, 4-7 ... */
+static int wake_pos_bucket(unsigned int pos)
 {
-	int len = strlen(str);
-	int maxlen = len * 2;
-	char *newstr = malloc(len * 2 + 1);
-	char *ptr = newstr;
+	int bucket;
 
-	if (!newstr) {
-		perror("malloc");
-		exit(1);
+	if (pos == 0)
+		return 0;
+	bucket = sizeof(pos) * 8 - __builtin_clz(pos);
+	if (bucket >= WAKE_POS_BUCKETS)
+		bucket = WAKE_POS_BUCKETS - 1;
+	return bucket;
+}
+
+static void wake_pos_label(int bucket, char *buf, int len)
+{
+	if (bucket == 0)
+		snprintf(buf, len, "0");
+	else if (bucket == 1)
+		snprintf(buf, len, "1");
+	else if (bucket == WAKE_POS_BUCKETS - 1)
+		snprintf(buf, len, "%u+", 1U << (bucket - 1));
+	else
+		snprintf(buf, len, "%u-%u", 1U << (bucket - 1),
+			 (1U << bucket) - 1);
+}
+
+/* --wake-mode, wakeup latencies broken down by batch position */
+static void show_wake_pos_latencies(struct stats *pos_stats,
+				    unsigned long long runtime)
+{
+	char label[64];
+	char pos[32];
+	int i;
+
+	for (i = 0; i < WAKE_POS_BUCKETS; i++) {
+		if (!pos_stats[i].nr_samples)
+			continue;
+		wake_pos_label(i, pos, sizeof(pos));
+		snprintf(label, sizeof(label), "Wakeup Latencies (batch pos %s)",
+			 pos);
+		show_latencies(pos_stats + i, label, "usec", runtime,
+			       PLIST_FOR_LAT, PLIST_99);
 	}
-	memcpy(newstr, str, len);
-	while ((ptr = strchr(ptr, '"'))) {
-		if (len == maxlen - 1) {
-			free(newstr);
-			return NULL;
-		}
-		memmove(ptr + 1, ptr, len - (ptr - newstr));
-		*ptr = '\\';
-		ptr += 2;
-		len++;
+}
+
+/* --wakeup-topology, wakeup latencies broken down by waker distance */
+static void show_dist_latencies(struct stats *dist_stats,
+				unsigned long long runtime)
+{
+	char label[64];
+	int i;
+
+	for (i = 0; i < NR_DIST; i++) {
+		if (!dist_stats[i].nr_samples)
+			continue;
+		snprintf(label, sizeof(label), "Wakeup Latencies (%s)",
+			 dist_names[i]);
+		show_latencies(dist_stats + i, label, "usec", runtime,
+			       PLIST_FOR_LAT, PLIST_99);
+	}
+}
+
+/* --breakdown, one histogram for each part of a request */
+static void show_breakdown_latencies(struct stats *bd_stats,
+				     unsigned long long runtime)
+{
+	char label[64];
+	int i;
+
+	for (i = 0; i < NR_BREAKDOWN; i++) {
+		if (!bd_stats[i].nr_samples)
+			continue;
+		snprintf(label, sizeof(label), "Request Latencies (%s)",
+			 breakdown_names[i]);
+		show_latencies(bd_stats + i, label, "usec", runtime,
+			       PLIST_FOR_LAT, PLIST_99);
 	}
-	newstr[len] = '\0';
-	return newstr;
 }
 
 static void chomp(char *buf)
@@ -677,11 +1690,26 @@ static void write_json_header(FILE *fp, char **argv, int argc)
 
 	print_sched_ext_info(fp);
 
+	if (wake_mode_specified)
+		fprintf(fp, "\"wake_mode\": \"%s\",", wake_mode_names[wake_mode]);
+	if (work_kernel != KERNEL_MATRIX)
+		fprintf(fp, "\"kernel\": \"%s\",", work_kernel_names[work_kernel]);
+	if (page_backing != PAGES_DEFAULT)
+		fprintf(fp, "\"hugepages\": \"%s\",", page_backing_names[page_backing]);
+	if (sleep_mode_specified)
+		fprintf(fp, "\"sleep_mode\": \"%s\",", sleep_mode_names[sleep_mode]);
+	if (requests_per_sec)
+		fprintf(fp, "\"pacing\": \"%s\",", pacing_names[pacing]);
+	if (worker_backing[0])
+		fprintf(fp, "\"worker_backing\": \"%s\",", worker_backing);
+	if (shared_backing[0])
+		fprintf(fp, "\"shared_backing\": \"%s\",", shared_backing);
+
 	fprintf(fp, "\"cmdline\": \"");
 	for (int i = 0; i < argc; i++) {
 		if (i)
 			fprintf(fp, " ");
-		if (strchr(argv[i], '"')) {
+		if (strpbrk(argv[i], "\"\\")) {
 			char *newstr = escape_string(argv[i]);
 			if (!newstr) {
 				fprintf(stderr, "escape_string failed\n");
@@ -720,1007 +1748,5339 @@ static void write_json_stats(FILE *fp, struct stats *s, char *label)
 		free(ocounts);
 }
 
-static void write_json_footer(FILE *fp)
-{
-	fprintf(fp, "}}");
-	fflush(fp);
-}
-
-/* fold latency info from s into d */
-void combine_stats(struct stats *d, struct stats *s)
+/* the --slo curve is its own section since it isn't a flat list of ints */
+static void write_json_slo(FILE *fp)
 {
 	int i;
-	for (i = 0; i < PLAT_NR; i++)
-		d->plat[i] += s->plat[i];
-	d->nr_samples += s->nr_samples;
-	if (s->max > d->max)
-		d->max = s->max;
-	if (d->min == 0 || s->min < d->min)
-		d->min = s->min;
+
+	fprintf(fp, ", \"slo_search\": {\"slo_usec\": %u, \"percentile\": %.1f, ",
+		slo_usec, slo_pct);
+	fprintf(fp, "\"step_sec\": %d, \"curve\": [", slo_step_sec);
+	for (i = 0; i < nr_slo_points; i++) {
+		struct slo_point *p = slo_curve + i;
+
+		fprintf(fp, "%s{\"rps\": %u, \"achieved_rps\": %.2f, \"latency\": %u, \"pass\": %s}",
+			i ? ", " : "", p->rps, p->achieved, p->latency,
+			p->pass ? "true" : "false");
+	}
+	fprintf(fp, "]}");
 }
 
-/* record a latency result into the histogram */
-static void add_lat(struct stats *s, unsigned int us)
+/* one entry per -R dispatcher, so we can see which ones ran out of cpu */
+static void write_json_dispatchers(FILE *fp)
 {
-	int lat_index = 0;
-
-	if (us > s->max)
-		s->max = us;
-	if (s->min == 0 || us < s->min)
-		s->min = us;
+	struct dispatcher *d;
+	int i;
 
-	lat_index = plat_val_to_idx(us);
-	__sync_fetch_and_add(&s->plat[lat_index], 1);
-	__sync_fetch_and_add(&s->nr_samples, 1);
+	fprintf(fp, ", \"dispatchers\": [");
+	for (i = 0; i < message_threads * nr_dispatchers; i++) {
+		d = dispatchers + i;
+		fprintf(fp, "%s{\"group\": %d, \"workers\": %d, \"sent\": %llu, ",
+			i ? ", " : "", i / nr_dispatchers, d->nr_workers,
+			d->sent);
+		fprintf(fp, "\"dropped\": %llu, \"overruns\": %llu, ",
+			d->dropped, d->overruns);
+		fprintf(fp, "\"lateness_pct50\": %u, \"lateness_pct99\": %u, ",
+			stats_percentile(&d->lateness, 50.0),
+			stats_percentile(&d->lateness, 99.0));
+		fprintf(fp, "\"cpu_pct\": %.1f}",
+			d->wall_ns ? (double)d->cpu_ns * 100 / d->wall_ns : 0);
+	}
+	fprintf(fp, "]");
 }
 
-struct request {
-	struct timeval start_time;
-	struct request *next;
-};
-
 /*
- * every thread has one of these, it comes out to about 19K thanks to the
- * giant stats struct
+ * the final histograms we write out in sparse form, so a later run can
+ * use this one as a --baseline
  */
-struct thread_data {
-	/* opaque pthread tid */
-	pthread_t tid;
-
-	/* actual tid from SYS_gettid */
-	unsigned long sys_tid;
-
-	/* used for pinning to CPUs etc, just a counter for which thread we are */
-	unsigned long index;
-	/* ->next is for placing us on the msg_thread's list for waking */
-	struct thread_data *next;
-
-	/* ->request is all of our pending request */
-	struct request *request;
+enum {
+	HIST_WAKEUP = 0,
+	HIST_REQUEST,
+	HIST_RPS,
+	NR_HIST,
+};
+static char *hist_names[] = { "wakeup_latency", "request_latency", "rps" };
+static struct stats *json_hists[NR_HIST];
 
-	/* our parent thread and messaging partner */
-	struct thread_data *msg_thread;
+/* "name": [[bucket, count], ...] for every occupied plat bucket */
+static void write_json_histograms(FILE *fp)
+{
+	unsigned long bits;
+	unsigned int i;
+	unsigned int w;
+	int first = 1;
+	int sep;
+	int h;
+
+	fprintf(fp, ", \"histograms\": {");
+	for (h = 0; h < NR_HIST; h++) {
+		if (!json_hists[h])
+			continue;
+		fprintf(fp, "%s\"%s\": [", first ? "" : ", ", hist_names[h]);
+		first = 0;
+		sep = 0;
+		for (w = 0; w < PLAT_USED_LONGS; w++) {
+			bits = json_hists[h]->used[w];
+			while (bits) {
+				i = w * BITS_PER_LONG + __builtin_ctzl(bits);
+				bits &= bits - 1;
+				if (!json_hists[h]->plat[i])
+					continue;
+				fprintf(fp, "%s[%u, %u]", sep ? ", " : "", i,
+					json_hists[h]->plat[i]);
+				sep = 1;
+			}
+		}
+		fprintf(fp, "]");
+	}
+	fprintf(fp, "}");
+}
 
-	/*
-	 * the msg thread stuffs gtod in here before waking us, so we can
-	 * measure scheduler latency
-	 */
-	struct timeval wake_time;
+/*
+ * the --baseline percentiles.  RPS only gets p50, it's one sample a
+ * second and the tails are mostly startup and shutdown
+ */
+static double baseline_plist[] = { 50.0, 90.0, 99.0, 99.9 };
+#define NR_BASELINE_PCT (sizeof(baseline_plist) / sizeof(baseline_plist[0]))
 
-	/* keep the futex and the wake_time in the same cacheline */
-	int futex;
+/*
+ * rounds of Poisson bootstrap for the confidence intervals, and how
+ * big a change has to be before we call it anything other than noise
+ */
+#define BOOTSTRAP_ROUNDS 1000
+#define BASELINE_MIN_EFFECT 0.02
 
-	/* mr axboe's magic latency histogram */
-	struct stats wakeup_stats;
-	struct stats request_stats;
-	unsigned long long avg_sched_delay;
-	unsigned long long loop_count;
-	unsigned long long runtime;
-	unsigned long pending;
+enum {
+	VERDICT_NOISE = 0,
+	VERDICT_IMPROVEMENT,
+	VERDICT_REGRESSION,
+};
+static char *verdict_names[] = { "noise", "improvement", "regression" };
+
+struct baseline_result {
+	int hist;
+	double pct;
+	unsigned int base;
+	unsigned int cur;
+	/* relative change and its 95% confidence interval */
+	double delta;
+	double lo;
+	double hi;
+	int verdict;
+};
 
-	char pipe_page[PIPE_TRANSFER_BUFFER];
+static struct baseline_result baseline_results[NR_HIST * NR_BASELINE_PCT];
+static int nr_baseline_results = 0;
+static int baseline_verdict = VERDICT_NOISE;
 
-	/* matrices to multiply */
-	unsigned long *data;
+/* a histogram as a list of occupied buckets in bucket order */
+struct sparse_hist {
+	unsigned int *idx;
+	unsigned long *count;
+	unsigned long *resampled;
+	int nr;
 };
 
-/* we're so fancy we make our own futex wrappers */
-#define FUTEX_BLOCKED 0
-#define FUTEX_RUNNING 1
-
-static int futex(int *uaddr, int futex_op, int val,
-		 const struct timespec *timeout, int *uaddr2, int val3)
+static void sparse_alloc(struct sparse_hist *sh, int nr)
 {
-	return syscall(SYS_futex, uaddr, futex_op, val, timeout, uaddr2, val3);
+	sh->idx = calloc(nr, sizeof(*sh->idx));
+	sh->count = calloc(nr, sizeof(*sh->count));
+	sh->resampled = calloc(nr, sizeof(*sh->resampled));
+	if (!sh->idx || !sh->count || !sh->resampled) {
+		perror("unable to allocate histogram");
+		exit(1);
+	}
+	sh->nr = 0;
 }
 
-/*
- * wakeup a process waiting on a futex, making sure they are really waiting
- * first
- */
-static void fpost(int *futexp)
+static void sparse_free(struct sparse_hist *sh)
 {
-	int s;
-
-	if (__sync_bool_compare_and_swap(futexp, FUTEX_BLOCKED,
-					 FUTEX_RUNNING)) {
-		s = futex(futexp, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
-		if (s  == -1) {
-			perror("FUTEX_WAKE");
-			exit(1);
-		}
-	}
+	free(sh->idx);
+	free(sh->count);
+	free(sh->resampled);
 }
 
-/*
- * wait on a futex, with an optional timeout.  Make sure to set
- * the futex to FUTEX_BLOCKED beforehand.
- *
- * This will return zero if all went well, or return -ETIMEDOUT if you
- * hit the timeout without getting posted
- */
-static int fwait(int *futexp, struct timespec *timeout)
+static void sparse_from_stats(struct sparse_hist *sh, struct stats *s)
 {
-	int s;
-	while (1) {
-		/* Is the futex available? */
-		if (__sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
-						 FUTEX_BLOCKED)) {
-			break;      /* Yes */
-		}
-		/* Futex is not available; wait */
-		s = futex(futexp, FUTEX_WAIT_PRIVATE, FUTEX_BLOCKED, timeout, NULL, 0);
-		if (s == -1 && errno != EAGAIN) {
-			if (errno == ETIMEDOUT)
-				return -ETIMEDOUT;
-			perror("futex-FUTEX_WAIT");
-			exit(1);
+	unsigned long bits;
+	unsigned int i;
+	unsigned int w;
+
+	sparse_alloc(sh, PLAT_NR);
+	for (w = 0; w < PLAT_USED_LONGS; w++) {
+		bits = s->used[w];
+		while (bits) {
+			i = w * BITS_PER_LONG + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			if (!s->plat[i])
+				continue;
+			sh->idx[sh->nr] = i;
+			sh->count[sh->nr++] = s->plat[i];
 		}
 	}
-	return 0;
 }
 
 /*
- * cmpxchg based list prepend
+ * pull one of our own histograms back out of a -j file.  This isn't a
+ * real json parser, it only knows the format write_json_histograms()
+ * makes.  Returns 0 if the histogram isn't there
  */
-static void xlist_add(struct thread_data *head, struct thread_data *add)
+static int sparse_from_json(struct sparse_hist *sh, char *json, char *name)
 {
-	struct thread_data *old;
-	struct thread_data *ret;
+	char key[64];
+	char *p;
+	char *end;
+	unsigned long idx;
+	unsigned long count;
+
+	p = strstr(json, "\"histograms\": {");
+	if (!p)
+		return 0;
+	snprintf(key, sizeof(key), "\"%s\": [", name);
+	p = strstr(p, key);
+	if (!p)
+		return 0;
+	p += strlen(key);
 
+	sparse_alloc(sh, PLAT_NR);
 	while (1) {
-		old = head->next;
-		add->next = old;
-		ret = __sync_val_compare_and_swap(&head->next, old, add);
-		if (ret == old)
+		while (*p == ' ' || *p == ',')
+			p++;
+		if (*p != '[')
+			break;
+		idx = strtoul(p + 1, &end, 10);
+		if (end == p + 1 || *end != ',')
+			break;
+		p = end + 1;
+		count = strtoul(p, &end, 10);
+		if (end == p || *end != ']' || idx >= PLAT_NR ||
+		    sh->nr >= PLAT_NR)
 			break;
+		p = end + 1;
+		sh->idx[sh->nr] = idx;
+		sh->count[sh->nr++] = count;
 	}
+	if (*p != ']') {
+		fprintf(stderr, "unable to parse %s histogram in %s\n", name,
+			baseline_file);
+		exit(1);
+	}
+	return 1;
 }
 
-/*
- * xchg based list splicing.  This returns the entire list and
- * replaces the head->next with NULL
- */
-static struct thread_data *xlist_splice(struct thread_data *head)
+static double gaussian(unsigned short *rand_state)
 {
-	struct thread_data *old;
-	struct thread_data *ret;
+	double u1 = 1.0 - erand48(rand_state);
+	double u2 = erand48(rand_state);
 
-	while (1) {
-		old = head->next;
-		ret = __sync_val_compare_and_swap(&head->next, old, NULL);
-		if (ret == old)
-			break;
-	}
-	return ret;
+	return sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
 }
 
-/*
- * cmpxchg based list prepend
- */
-static struct request *request_add(struct thread_data *head, struct request *add)
+/* a Poisson(mean) sample, normal approximation for the big ones */
+static unsigned long poisson(unsigned long mean, unsigned short *rand_state)
 {
-	struct request *old;
-	struct request *ret;
-
-	while (1) {
-		old = head->request;
-		add->next = old;
-		ret = __sync_val_compare_and_swap(&head->request, old, add);
-		if (ret == old)
-			return old;
+	double limit;
+	double p = 1.0;
+	double v;
+	unsigned long k = 0;
+
+	if (mean > 30) {
+		v = mean + sqrt(mean) * gaussian(rand_state) + 0.5;
+		return v < 0 ? 0 : v;
 	}
+	limit = exp(-(double)mean);
+	do {
+		k++;
+		p *= erand48(rand_state);
+	} while (p > limit);
+	return k - 1;
 }
 
-/*
- * xchg based list splicing.  This returns the entire list and
- * replaces the head->request with NULL.  The list is reversed before
- * returning
- */
-static struct request *request_splice(struct thread_data *head)
+/* fill in vals[] with the value at each percentile of counts[] */
+static void sparse_percentiles(struct sparse_hist *sh, unsigned long *counts,
+			       unsigned int *vals)
 {
-	struct request *old;
-	struct request *ret;
-	struct request *reverse = NULL;
-
-	while (1) {
-		old = head->request;
-		ret = __sync_val_compare_and_swap(&head->request, old, NULL);
-		if (ret == old)
-			break;
-	}
+	unsigned long total = 0;
+	unsigned long sum = 0;
+	unsigned int j = 0;
+	int i;
 
-	while(ret) {
-		struct request *tmp = ret;
-		ret = ret->next;
-		tmp->next = reverse;
-		reverse = tmp;
+	for (i = 0; i < sh->nr; i++)
+		total += counts[i];
+	memset(vals, 0, NR_BASELINE_PCT * sizeof(*vals));
+	for (i = 0; i < sh->nr && j < NR_BASELINE_PCT; i++) {
+		sum += counts[i];
+		while (j < NR_BASELINE_PCT &&
+		       sum >= baseline_plist[j] / 100.0 * total)
+			vals[j++] = plat_idx_to_val(sh->idx[i]);
 	}
-	return reverse;
 }
 
-static struct request *allocate_request(void)
+static int cmp_double(const void *a, const void *b)
 {
-	struct request *ret = malloc(sizeof(*ret));
+	double x = *(const double *)a;
+	double y = *(const double *)b;
 
-	if (!ret) {
-		perror("malloc");
-		exit(1);
-	}
-
-	gettimeofday(&ret->start_time, NULL);
-	ret->next = NULL;
-	return ret;
+	return x < y ? -1 : x > y;
 }
 
-
 /*
- * Wake everyone currently waiting on the message list, filling in their
- * thread_data->wake_time with the current time.
- *
- * It's not exactly the current time, it's really the time at the start of
- * the list run.  We want to detect when the scheduler is just preempting the
- * waker and giving away the rest of its timeslice.  So we gtod once at
- * the start of the loop and use that for all the threads we wake.
- *
- * Since pipe mode ends up measuring this other ways, we do the gtod
- * every time in pipe mode
+ * compare one histogram against the baseline.  Poisson bootstrap: every
+ * round scales each bucket's count by a Poisson(1) weight, which for a
+ * bucket of count c is a Poisson(c) draw, and we take the 2.5% and 97.5%
+ * points of the change in each percentile
  */
-static void xlist_wake_all(struct thread_data *td)
+static void compare_hist(int hist, struct sparse_hist *base,
+			 struct sparse_hist *cur, int nr_pct)
 {
-	struct thread_data *list;
-	struct thread_data *next;
-	struct timeval now;
+	unsigned short rand_state[3] = { 0x5c4b, 0x3e5c, (unsigned short)hist };
+	unsigned int base_vals[NR_BASELINE_PCT];
+	unsigned int cur_vals[NR_BASELINE_PCT];
+	double *deltas;
+	struct baseline_result *r;
+	int higher_is_better = hist == HIST_RPS;
+	int nr_deltas[NR_BASELINE_PCT] = { 0 };
+	int round;
+	int i;
+	int j;
 
-	list = xlist_splice(td);
-	gettimeofday(&now, NULL);
-	while (list) {
-		next = list->next;
-		list->next = NULL;
-		if (pipe_test) {
-			memset(list->pipe_page, 1, pipe_test);
-			gettimeofday(&list->wake_time, NULL);
-		} else {
-			memcpy(&list->wake_time, &now, sizeof(now));
-		}
-		fpost(&list->futex);
-		list = next;
+	deltas = calloc(BOOTSTRAP_ROUNDS * NR_BASELINE_PCT, sizeof(*deltas));
+	if (!deltas) {
+		perror("unable to allocate bootstrap");
+		exit(1);
 	}
-}
-
-/*
- * called by worker threads to send a message and wait for the answer.
- * In reality we're just trading one cacheline with the gtod and futex in
- * it, but that's good enough.  We gtod after waking and use that to
- * record scheduler latency.
- */
-static struct request *msg_and_wait(struct thread_data *td)
-{
-	struct request *req;
-	struct timeval now;
-	unsigned long long delta;
-
-	if (pipe_test)
-		memset(td->pipe_page, 2, pipe_test);
-
-	/* set ourselves to blocked */
-	td->futex = FUTEX_BLOCKED;
-	gettimeofday(&td->wake_time, NULL);
 
-	/* add us to the list */
-	if (requests_per_sec) {
-		td->pending = 0;
-		req = request_splice(td);
-		if (req) {
-			td->futex = FUTEX_RUNNING;
-			return req;
+	for (round = 0; round < BOOTSTRAP_ROUNDS; round++) {
+		for (i = 0; i < base->nr; i++)
+			base->resampled[i] = poisson(base->count[i], rand_state);
+		for (i = 0; i < cur->nr; i++)
+			cur->resampled[i] = poisson(cur->count[i], rand_state);
+		sparse_percentiles(base, base->resampled, base_vals);
+		sparse_percentiles(cur, cur->resampled, cur_vals);
+		/* small histograms can resample down to nothing, skip those */
+		for (j = 0; j < nr_pct; j++) {
+			if (!base_vals[j] || !cur_vals[j])
+				continue;
+			deltas[j * BOOTSTRAP_ROUNDS + nr_deltas[j]++] =
+				((double)cur_vals[j] - base_vals[j]) / base_vals[j];
 		}
-	} else {
-		xlist_add(td->msg_thread, td);
 	}
 
-	fpost(&td->msg_thread->futex);
-
-	/*
-	 * don't wait if the main threads are shutting down,
-	 * they will never kick us fpost has a full barrier, so as long
-	 * as the message thread walks his list after setting stopping,
-	 * we shouldn't miss the wakeup
-	 */
-	if (!stopping) {
-		/* if he hasn't already woken us up, wait */
-		fwait(&td->futex, NULL);
+	sparse_percentiles(base, base->count, base_vals);
+	sparse_percentiles(cur, cur->count, cur_vals);
+	for (j = 0; j < nr_pct; j++) {
+		double *d = deltas + j * BOOTSTRAP_ROUNDS;
+		int n = nr_deltas[j];
+
+		qsort(d, n, sizeof(*d), cmp_double);
+		r = baseline_results + nr_baseline_results++;
+		r->hist = hist;
+		r->pct = baseline_plist[j];
+		r->base = base_vals[j];
+		r->cur = cur_vals[j];
+		r->delta = base_vals[j] ?
+			((double)cur_vals[j] - base_vals[j]) / base_vals[j] : 0;
+		r->verdict = VERDICT_NOISE;
+		/* not enough samples to say anything */
+		if (n < BOOTSTRAP_ROUNDS / 2) {
+			r->lo = -1;
+			r->hi = 1;
+			continue;
+		}
+		r->lo = d[n * 25 / 1000];
+		r->hi = d[(n * 975 + 999) / 1000 - 1];
+
+		/* the whole interval has to be past BASELINE_MIN_EFFECT */
+		if (r->lo > BASELINE_MIN_EFFECT)
+			r->verdict = higher_is_better ? VERDICT_IMPROVEMENT :
+				VERDICT_REGRESSION;
+		else if (r->hi < -BASELINE_MIN_EFFECT)
+			r->verdict = higher_is_better ? VERDICT_REGRESSION :
+				VERDICT_IMPROVEMENT;
+
+		if (r->verdict == VERDICT_REGRESSION)
+			baseline_verdict = VERDICT_REGRESSION;
+		else if (r->verdict == VERDICT_IMPROVEMENT &&
+			 baseline_verdict == VERDICT_NOISE)
+			baseline_verdict = VERDICT_IMPROVEMENT;
 	}
-	gettimeofday(&now, NULL);
-	delta = tvdelta(&td->wake_time, &now);
-	if (delta > 0)
-		add_lat(&td->wakeup_stats, delta);
-
-	return NULL;
+	free(deltas);
 }
 
 /*
- * read /proc/stat, return the percentage of non-idle time since
- * the last read.
+ * --baseline, compare the histograms from this run against the ones in
+ * baseline_file and print what changed
  */
-float read_busy(int fd, char *buf, int len,
-		unsigned long long *total_time_ret,
-		unsigned long long *idle_time_ret)
+static void compare_baseline(void)
 {
-	unsigned long long total_time = 0;
-	unsigned long long idle_time = 0;
-	unsigned long long delta;
-	unsigned long long delta_idle;
-	unsigned long long val;
-	int col = 1;
-	int ret;
-	char *c;
-	char *save = NULL;
-
-
-	ret = lseek(fd, 0, SEEK_SET);
-	if (ret < 0) {
-		perror("lseek");
+	struct sparse_hist base;
+	struct sparse_hist cur;
+	struct stat st;
+	char *json;
+	FILE *fp;
+	int h;
+
+	fp = fopen(baseline_file, "r");
+	if (!fp || fstat(fileno(fp), &st)) {
+		perror("unable to open baseline");
 		exit(1);
 	}
-	ret = read(fd, buf, len-1);
-	if (ret < 0) {
-		perror("failed to read /proc/stat");
+	json = malloc(st.st_size + 1);
+	if (!json) {
+		perror("unable to allocate baseline");
 		exit(1);
 	}
-	buf[ret] = '\0';
-
-	/* find the newline */
-	c = strchr(buf, '\n');
-	if (c == NULL) {
-		perror("unable to parse /proc/stat");
+	if (fread(json, 1, st.st_size, fp) != (size_t)st.st_size) {
+		perror("unable to read baseline");
 		exit(1);
 	}
-	*c = '\0';
+	json[st.st_size] = '\0';
+	fclose(fp);
 
-	/* cpu  590315893 45841886 375984879 82585100131 166708940 0 5453892 0 0 0 */
-	c = strtok_r(buf, " ", &save);
-	if (strcmp(c, "cpu") != 0) {
-		perror("unable to parse summary in /proc/stat");
-		exit(1);
+	for (h = 0; h < NR_HIST; h++) {
+		if (!json_hists[h] || !json_hists[h]->nr_samples)
+			continue;
+		if (!sparse_from_json(&base, json, hist_names[h])) {
+			fprintf(stderr, "%s has no %s histogram, it needs a -j file written with --save-histograms\n",
+				baseline_file, hist_names[h]);
+			continue;
+		}
+		sparse_from_stats(&cur, json_hists[h]);
+		if (base.nr)
+			compare_hist(h, &base, &cur,
+				     h == HIST_RPS ? 1 : NR_BASELINE_PCT);
+		sparse_free(&base);
+		sparse_free(&cur);
 	}
+	free(json);
+}
 
-	while (c != NULL) {
-		c = strtok_r(NULL, " ", &save);
-		if (!c)
-			break;
-		val = atoll(c);
-		if (col++ == 4)
-			idle_time = val;
-		total_time += val;
-	}
+static void show_baseline(void)
+{
+	struct baseline_result *r;
+	int i;
 
-	if (*total_time_ret == 0) {
-		*total_time_ret = total_time;
-		*idle_time_ret = idle_time;
-		return 0.0;
+	fprintf(stderr, "compared to baseline %s (95%% CI):\n", baseline_file);
+	for (i = 0; i < nr_baseline_results; i++) {
+		r = baseline_results + i;
+		fprintf(stderr, "\t%s p%.1f: %u -> %u (%+.1f%%, %+.1f%% .. %+.1f%%) %s\n",
+			hist_names[r->hist], r->pct, r->base, r->cur,
+			r->delta * 100, r->lo * 100, r->hi * 100,
+			verdict_names[r->verdict]);
 	}
+	fprintf(stderr, "verdict: %s\n", verdict_names[baseline_verdict]);
+}
 
-	/* delta is the total time spent doing everything */
-	delta = total_time - *total_time_ret;
-	delta_idle = idle_time - *idle_time_ret;
-
-	*total_time_ret = total_time;
-	*idle_time_ret = idle_time;
+static void write_json_baseline(FILE *fp)
+{
+	struct baseline_result *r;
+	int i;
 
-	return 100.00 - ((float)delta_idle/(float)delta) * 100.00;
+	fprintf(fp, ", \"baseline\": {\"file\": \"%s\", \"verdict\": \"%s\", \"results\": [",
+		baseline_json_file, verdict_names[baseline_verdict]);
+	for (i = 0; i < nr_baseline_results; i++) {
+		r = baseline_results + i;
+		fprintf(fp, "%s{\"metric\": \"%s\", \"percentile\": %.1f, ",
+			i ? ", " : "", hist_names[r->hist], r->pct);
+		fprintf(fp, "\"baseline\": %u, \"current\": %u, \"delta\": %.4f, ",
+			r->base, r->cur, r->delta);
+		fprintf(fp, "\"ci_low\": %.4f, \"ci_high\": %.4f, \"verdict\": \"%s\"}",
+			r->lo, r->hi, verdict_names[r->verdict]);
+	}
+	fprintf(fp, "]}");
 }
 
 /*
- * read the schedstats for a process and return the average scheduling delay
- * in nanoseconds
+ * --iterations results, the --baseline percentiles of each histogram
+ * for every iteration.  Indexed by [iteration][hist][pct]
  */
-unsigned long long read_sched_delay(pid_t tid)
-{
-	unsigned long long runqueue_ns = 0;
-	unsigned long long running_ns = 0;
-	unsigned long long nr_scheduled = 0;
-	char path[96];
+static double *iter_vals = NULL;
 
-	snprintf(path, sizeof(path), "/proc/%d/schedstat", tid);
+#define ITER_VAL(iter, h, j) \
+	iter_vals[((iter) * NR_HIST + (h)) * NR_BASELINE_PCT + (j)]
 
-	FILE *fp = fopen(path, "r");
-	if (!fp) {
-		/* this can happen during final stats print at exit */
+/*
+ * two sided 95% t values for 1 to 30 degrees of freedom, past that the
+ * normal 1.96 is close enough
+ */
+static double t95[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+/* RPS only gets p50, same as --baseline */
+static int iter_metric_valid(int h, int j)
+{
+	if (h == HIST_RPS && j)
 		return 0;
-	}
+	return json_hists[h] != NULL;
+}
 
-	/*
-	 * proc_pid_schedstat() in the kernel prints:
-	 * runtime, delay, pcount
-	 */
-	int ret = fscanf(fp, "%llu %llu %llu", &running_ns, &runqueue_ns,
-			 &nr_scheduled);
-	fclose(fp);
+/* hists is laid out like json_hists, but just this iteration's samples */
+static void record_iteration(int iter, struct stats **hists)
+{
+	unsigned int h;
+	unsigned int j;
 
-	if (ret != 3) {
-		fprintf(stderr, "Failed to parse %s\n", path);
-		exit(1);
+	for (h = 0; h < NR_HIST; h++) {
+		if (!hists[h])
+			continue;
+		for (j = 0; j < NR_BASELINE_PCT; j++)
+			ITER_VAL(iter, h, j) = stats_percentile(hists[h],
+								baseline_plist[j]);
 	}
-
-	return runqueue_ns / nr_scheduled;
 }
 
-#if defined(__x86_64__) || defined(__i386__)
-#define nop __asm__ __volatile__("rep;nop": : :"memory")
-#elif defined(__aarch64__)
-#define nop __asm__ __volatile__("yield" ::: "memory")
-#elif defined(__powerpc64__) || defined(__s390__)
-#define nop __asm__ __volatile__("nop": : :"memory")
-#elif defined(__riscv)
-#define nop __asm__ __volatile__("nop": : :"memory")
-#else
-#error Unsupported architecture
-#endif
-
-/*
- * once the message thread starts all his children, this is where he
- * loops until our runtime is up.  Basically this sits around waiting
- * for posting by the worker threads, and replying to their messages.
- */
-static void run_msg_thread(struct thread_data *td)
+/* mean, sample stddev and the 95% confidence interval of the mean */
+static void iter_summary(int h, int j, double *mean, double *stddev,
+			 double *ci)
 {
-	while (1) {
-		td->futex = FUTEX_BLOCKED;
-		xlist_wake_all(td);
+	double sum = 0;
+	double sq = 0;
+	double d;
+	int i;
 
-		if (stopping) {
-			xlist_wake_all(td);
-			break;
-		}
-		fwait(&td->futex, NULL);
+	for (i = 0; i < iterations; i++)
+		sum += ITER_VAL(i, h, j);
+	*mean = sum / iterations;
+	for (i = 0; i < iterations; i++) {
+		d = ITER_VAL(i, h, j) - *mean;
+		sq += d * d;
 	}
+	*stddev = sqrt(sq / (iterations - 1));
+	*ci = (iterations - 1 <= 30 ? t95[iterations - 2] : 1.96) *
+		*stddev / sqrt(iterations);
 }
 
-void auto_scale_rps(int *proc_stat_fd,
-		    unsigned long long *total_time,
-		    unsigned long long *total_idle)
+static void show_iterations(void)
 {
-	int fd = *proc_stat_fd;
-	float busy = 0;
-	char proc_stat_buf[512];
-	int first_run = 0;
-	float delta;
-	float target = 1;
-
-	if (fd == -1) {
-		fd = open("/proc/stat", O_RDONLY);
-		if (fd < 0) {
-			perror("unable to open /proc/stat");
-			exit(1);
+	double mean;
+	double stddev;
+	double ci;
+	unsigned int h;
+	unsigned int j;
+
+	fprintf(stderr, "%d iterations%s, mean stddev (95%% CI):\n", iterations,
+		respawn ? " respawned" : "");
+	for (h = 0; h < NR_HIST; h++) {
+		for (j = 0; j < NR_BASELINE_PCT; j++) {
+			if (!iter_metric_valid(h, j))
+				continue;
+			iter_summary(h, j, &mean, &stddev, &ci);
+			fprintf(stderr, "\t%s p%.1f: %.1f stddev %.1f (%.1f .. %.1f)\n",
+				hist_names[h], baseline_plist[j], mean, stddev,
+				mean - ci, mean + ci);
 		}
-		*proc_stat_fd = fd;
-		first_run = 1;
 	}
-	busy = read_busy(fd, proc_stat_buf, 512, total_time, total_idle);
-	if (first_run)
-		return;
-	if (busy < auto_rps) {
-		delta = (float)auto_rps / busy;
-		/* delta is > 1 */
-		if (delta > 3) {
-			delta = 3;
-		} else if (delta < 1.2) {
-			delta = 1 + (delta - 1) / 8;
-			if (delta < 1.05 && !auto_rps_target_hit) {
-				auto_rps_target_hit = 1;
-				memset(&rps_stats, 0, sizeof(rps_stats));
-			}
+}
 
-		} else if (delta < 1.5) {
-			delta = 1 + (delta - 1) / 4;
-		}
-		target = ceilf((float)requests_per_sec * delta);
-		if (target >= (1ULL << 31)) {
-			/*
-			 * sometimes we don't have enough threads to hit the
-			 * target load
-			 */
-			target = requests_per_sec;
-		}
-	} else if (busy > auto_rps) {
-		/* delta < 1 */
-		delta = (float)auto_rps / busy;
-		if (delta < 0.3) {
-			delta = 0.3;
-		} else if (delta > .9) {
-			delta += (1 - delta) / 8;
-			if (delta > .95 && !auto_rps_target_hit) {
-				auto_rps_target_hit = 1;
-				memset(&rps_stats, 0, sizeof(rps_stats));
-			}
-		} else if (delta > .8) {
-			delta += (1 - delta) / 4;
-		}
-		target = floorf((float)requests_per_sec * delta);
-		if (target <= 0)
-			target = 0;
-	} else {
-		target = requests_per_sec;
-		if (!auto_rps_target_hit) {
-			auto_rps_target_hit = 1;
-			memset(&rps_stats, 0, sizeof(rps_stats));
+static void write_json_iterations(FILE *fp)
+{
+	double mean;
+	double stddev;
+	double ci;
+	unsigned int h;
+	unsigned int j;
+	int sep = 0;
+	int i;
+
+	fprintf(fp, ", \"iterations\": {\"count\": %d, \"respawn\": %d, \"results\": [",
+		iterations, respawn);
+	for (h = 0; h < NR_HIST; h++) {
+		for (j = 0; j < NR_BASELINE_PCT; j++) {
+			if (!iter_metric_valid(h, j))
+				continue;
+			iter_summary(h, j, &mean, &stddev, &ci);
+			fprintf(fp, "%s{\"metric\": \"%s\", \"percentile\": %.1f, ",
+				sep ? ", " : "", hist_names[h], baseline_plist[j]);
+			fprintf(fp, "\"mean\": %.2f, \"stddev\": %.2f, ", mean, stddev);
+			fprintf(fp, "\"ci_low\": %.2f, \"ci_high\": %.2f, \"values\": [",
+				mean - ci, mean + ci);
+			for (i = 0; i < iterations; i++)
+				fprintf(fp, "%s%.0f", i ? ", " : "",
+					ITER_VAL(i, h, j));
+			fprintf(fp, "]}");
+			sep = 1;
 		}
 	}
-	requests_per_sec = target;
+	fprintf(fp, "]}");
 }
 
+/* the knobs a --phases line can turn */
+enum {
+	PHASE_RPS = 0,
+	PHASE_THREADS,
+	PHASE_OPS,
+	PHASE_SLEEP,
+	NR_PHASE_KNOBS,
+};
+static char *phase_knob_names[] = { "rps", "threads", "ops", "sleep" };
+
+/* how a knob given as from:to moves over its phase */
+enum {
+	SHAPE_STEP = 0,
+	SHAPE_RAMP,
+	SHAPE_SQUARE,
+	SHAPE_SINE,
+};
+static char *shape_names[] = { "step", "ramp", "square", "sine", NULL };
+
+struct phase {
+	unsigned int duration;
+	int shape;
+	/* seconds, for square and sine */
+	double period;
+	int set[NR_PHASE_KNOBS];
+	double from[NR_PHASE_KNOBS];
+	double to[NR_PHASE_KNOBS];
+
+	/* filled in as the phase finishes */
+	double seconds;
+	double rps;
+	unsigned int wakeup[NR_BASELINE_PCT];
+	unsigned int request[NR_BASELINE_PCT];
+	unsigned long nr_samples;
+};
+
+static struct phase *phases = NULL;
+static int nr_phases = 0;
+static pthread_t phase_tid;
+/* how many phases have results */
+static int nr_phases_done = 0;
+
 /*
- * once the message thread starts all his children, this is where he
- * loops until our runtime is up.  Basically this sits around waiting
- * for posting by the worker threads, replying to their messages.
+ * read the --phases file.  Each line is a duration in seconds and then
+ * any of rps=, threads=, ops= and sleep=, either a single value or
+ * from:to, and an optional shape=step|ramp|square:period|sine:period for
+ * the from:to knobs.  Knobs a phase doesn't mention keep their last value.
+ * Blank lines and anything after a # are ignored
  */
-static void run_rps_thread(struct thread_data *worker_threads_mem)
+static void read_phases(void)
 {
-	/* start and end of the thread run */
-	struct timeval start;
-	struct timeval now;
-	struct request *request;
-	unsigned long long delta;
-
-	/* how long do we sleep between each wake */
-	unsigned long batch = 128;
-	int cur_tid = 0;
+	char line[1024];
+	char *tok;
+	char *val;
+	char *end;
+	struct phase *p;
+	FILE *fp;
+	int lineno = 0;
 	int i;
 
-	while (1) {
-		gettimeofday(&start, NULL);
-		for (i = 1; i < requests_per_sec + 1; i++) {
-			struct thread_data *worker;
+	fp = fopen(phases_file, "r");
+	if (!fp) {
+		perror("unable to open phases file");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		end = strchr(line, '#');
+		if (end)
+			*end = '\0';
+		tok = strtok(line, " \t\n");
+		if (!tok)
+			continue;
 
-			if (stopping)
-				break;
-			gettimeofday(&now, NULL);
-
-			worker = worker_threads_mem + cur_tid % worker_threads;
-			cur_tid++;
+		phases = realloc(phases, (nr_phases + 1) * sizeof(*phases));
+		if (!phases) {
+			perror("unable to allocate phases");
+			exit(1);
+		}
+		p = phases + nr_phases++;
+		memset(p, 0, sizeof(*p));
+		p->duration = strtoul(tok, &end, 10);
+		if (*end || !p->duration) {
+			fprintf(stderr, "%s:%d: bad duration %s\n", phases_file,
+				lineno, tok);
+			exit(1);
+		}
 
-			/* at some point, there's just too much, don't queue more */
-			if (worker->pending > batch) {
-				__sync_synchronize();
-				if (worker->pending > batch) {
-					usleep(100);
-					continue;
+		while ((tok = strtok(NULL, " \t\n"))) {
+			val = strchr(tok, '=');
+			if (!val)
+				goto bad;
+			*val++ = '\0';
+			if (!strcmp(tok, "shape")) {
+				end = strchr(val, ':');
+				if (end)
+					*end++ = '\0';
+				for (i = 0; shape_names[i]; i++) {
+					if (!strcmp(val, shape_names[i]))
+						break;
+				}
+				if (!shape_names[i])
+					goto bad;
+				p->shape = i;
+				if (i == SHAPE_SQUARE || i == SHAPE_SINE) {
+					p->period = end ? atof(end) : 0;
+					if (p->period <= 0)
+						goto bad;
 				}
+				continue;
+			}
+			for (i = 0; i < NR_PHASE_KNOBS; i++) {
+				if (!strcmp(tok, phase_knob_names[i]))
+					break;
 			}
-			worker->pending++;
-			request = allocate_request();
-			request_add(worker, request);
-			memcpy(&worker->wake_time, &now, sizeof(now));
-			fpost(&worker->futex);
+			if (i == NR_PHASE_KNOBS)
+				goto bad;
+			p->set[i] = 1;
+			p->from[i] = strtod(val, &end);
+			p->to[i] = p->from[i];
+			if (*end == ':')
+				p->to[i] = strtod(end + 1, &end);
+			if (*end || p->from[i] < 0 || p->to[i] < 0)
+				goto bad;
 		}
-		gettimeofday(&now, NULL);
+	}
+	fclose(fp);
+	if (!nr_phases) {
+		fprintf(stderr, "no phases in %s\n", phases_file);
+		exit(1);
+	}
 
-		delta = tvdelta(&start, &now);
-		while (!stopping && delta < USEC_PER_SEC) {
-			delta = USEC_PER_SEC - delta;
-			usleep(delta);
+	/* the schedule replaces -r, and rps= needs the dispatchers from -R */
+	runtime = 0;
+	for (i = 0; i < nr_phases; i++) {
+		runtime += phases[i].duration;
+		if (!requests_per_sec && phases[i].set[PHASE_RPS])
+			requests_per_sec = phases[i].from[PHASE_RPS];
+	}
+	return;
+bad:
+	fprintf(stderr, "%s:%d: can't parse %s\n", phases_file, lineno, tok);
+	exit(1);
+}
 
-			gettimeofday(&now, NULL);
-			delta = tvdelta(&start, &now);
-		}
+static void write_json_phases(FILE *fp)
+{
+	struct phase *p;
+	unsigned int j;
+	int i;
 
-		if (stopping) {
-			for (i = 0; i < worker_threads; i++)
-				fpost(&worker_threads_mem[i].futex);
-			break;
-		}
+	fprintf(fp, ", \"phases\": [");
+	for (i = 0; i < nr_phases_done; i++) {
+		p = phases + i;
+		fprintf(fp, "%s{\"phase\": %d, \"duration\": %u, \"seconds\": %.2f, \"rps\": %.2f, ",
+			i ? ", " : "", i, p->duration, p->seconds, p->rps);
+		fprintf(fp, "\"wakeup_latency\": {");
+		for (j = 0; j < NR_BASELINE_PCT; j++)
+			fprintf(fp, "%s\"p%.1f\": %u", j ? ", " : "",
+				baseline_plist[j], p->wakeup[j]);
+		fprintf(fp, "}, \"request_latency\": {");
+		for (j = 0; j < NR_BASELINE_PCT; j++)
+			fprintf(fp, "%s\"p%.1f\": %u", j ? ", " : "",
+				baseline_plist[j], p->request[j]);
+		fprintf(fp, "}}");
 	}
+	fprintf(fp, "]");
 }
 
 /*
- * multiply two matrices in a naive way to emulate some cache footprint
+ * recovery tracking for --burst.  After each event the histograms are
+ * diffed every TIMELINE_SLOT_MS, and we wait for wakeup and request
+ * p50/p99 to get back within RECOVERY_PCT of where they were in the
+ * second before the event.  Request latency doesn't include time spent
+ * queued, so with -R the backlog of dispatched but unfinished requests
+ * also has to drain back down.  Slots with fewer than
+ * RECOVERY_MIN_SAMPLES requests are folded into the next one.
  */
-static void do_some_math(unsigned long *data, unsigned long msize)
-{
-	unsigned long i, j, k;
-	unsigned long *m1, *m2, *m3;
+#define TIMELINE_SLOT_MS 100
+#define TIMELINE_MAX_SLOTS 600
+#define RECOVERY_MIN_SAMPLES 20
+#define RECOVERY_PCT 10
 
-	m1 = &data[0];
-	m2 = &data[msize * msize];
-	m3 = &data[2 * msize * msize];
+enum {
+	REC_WAKE_P50 = 0,
+	REC_WAKE_P99,
+	REC_REQ_P50,
+	REC_REQ_P99,
+	NR_REC,
+};
 
-	for (i = 0; i < msize; i++) {
-		for (j = 0; j < msize; j++) {
-			m3[i * msize + j] = 0;
+struct recovery_event {
+	/* -1 if we never got back before the next event */
+	double recovery_ms;
+	/* the worst slot after the event, and the second before it */
+	unsigned int worst_wakeup_p99;
+	unsigned int worst_request_p99;
+	double min_rps;
+	double ref_rps;
+	unsigned int peak_pending;
+	double mean_peak_pending;
+};
 
-			for (k = 0; k < msize; k++)
-				m3[i * msize + j] +=
-					m1[i * msize + k] *
-					m2[k * msize + j];
-		}
-	}
-}
+struct recovery {
+	char *name;
+	/* cumulative wakeup and request histograms at the last mark */
+	struct stats *snap;
+	struct stats *cur;
+	struct stats *delta;
+	/* requests finished and the time at the last mark */
+	unsigned long long loops;
+	unsigned long long mark_ns;
+	/* requests dispatched but not finished, and RPS, for the last window */
+	long long backlog;
+	double rps;
+	/* where we have to get back to */
+	unsigned int ref[NR_REC];
+	long long ref_backlog;
+
+	/* p99s and backlog summed per slot across every event, for the timeline */
+	double wakeup_sum[TIMELINE_MAX_SLOTS];
+	double request_sum[TIMELINE_MAX_SLOTS];
+	double rps_sum[TIMELINE_MAX_SLOTS];
+	double backlog_sum[TIMELINE_MAX_SLOTS];
+	unsigned int slot_events[TIMELINE_MAX_SLOTS];
+
+	struct recovery_event *events;
+	int nr_events;
+};
 
-static pthread_mutex_t *lock_this_cpu(void)
+static struct recovery burst_recovery = { .name = "burst" };
+static pthread_t burst_tid;
+static struct recovery churn_recovery = { .name = "churn" };
+static pthread_t churn_tid;
+
+static void show_recovery(struct recovery *rec)
 {
-	int cpu;
-	int cur_cpu;
-	pthread_mutex_t *lock;
+	struct recovery_event *ev;
+	double *ms;
+	double mean_peak = 0;
+	unsigned int max_peak = 0;
+	int nr = 0;
+	int i;
 
-again:
-	cpu = sched_getcpu();
-	if (cpu < 0) {
-		perror("sched_getcpu failed\n");
+	if (!rec->nr_events)
+		return;
+	ms = calloc(rec->nr_events, sizeof(*ms));
+	if (!ms) {
+		perror("unable to allocate recovery times");
 		exit(1);
 	}
-	lock = &per_cpu_locks[cpu].lock;
-	while (pthread_mutex_trylock(lock) != 0)
-		nop;
-
-	cur_cpu = sched_getcpu();
-	if (cur_cpu < 0) {
-		perror("sched_getcpu failed\n");
-		exit(1);
+	for (i = 0; i < rec->nr_events; i++) {
+		ev = rec->events + i;
+		if (ev->recovery_ms >= 0)
+			ms[nr++] = ev->recovery_ms;
+		if (ev->peak_pending > max_peak)
+			max_peak = ev->peak_pending;
+		mean_peak += ev->mean_peak_pending;
 	}
+	mean_peak /= rec->nr_events;
+	qsort(ms, nr, sizeof(*ms), cmp_double);
+	fprintf(stderr, "%s recovery: %d events, %d recovered", rec->name,
+		rec->nr_events, nr);
+	if (nr)
+		fprintf(stderr, ", p50 %.0f ms max %.0f ms", ms[nr / 2],
+			ms[nr - 1]);
+	fprintf(stderr, ", peak pending per worker max %u mean %.1f\n",
+		max_peak, mean_peak);
+	free(ms);
+}
 
-	if (cur_cpu != cpu) {
-		/* we got the lock but we migrated */
-		pthread_mutex_unlock(lock);
-		goto again;
-	}
-	return lock;
+/* the events and the per slot timeline, averaged over every event */
+static void write_json_recovery(FILE *fp, struct recovery *rec)
+{
+	struct recovery_event *ev;
+	int sep = 0;
+	int i;
 
+	fprintf(fp, "\"events\": [");
+	for (i = 0; i < rec->nr_events; i++) {
+		ev = rec->events + i;
+		fprintf(fp, "%s{\"recovery_ms\": %.1f, \"worst_wakeup_p99\": %u, \"worst_request_p99\": %u, ",
+			i ? ", " : "", ev->recovery_ms, ev->worst_wakeup_p99,
+			ev->worst_request_p99);
+		fprintf(fp, "\"min_rps\": %.1f, \"ref_rps\": %.1f, \"peak_pending\": %u, \"mean_peak_pending\": %.2f}",
+			ev->min_rps, ev->ref_rps, ev->peak_pending,
+			ev->mean_peak_pending);
+	}
+	fprintf(fp, "], \"timeline\": [");
+	for (i = 0; i < TIMELINE_MAX_SLOTS; i++) {
+		if (!rec->slot_events[i])
+			continue;
+		fprintf(fp, "%s{\"ms\": %d, \"wakeup_p99\": %.1f, \"request_p99\": %.1f, \"rps\": %.1f, \"backlog\": %.1f}",
+			sep ? ", " : "", (i + 1) * TIMELINE_SLOT_MS,
+			rec->wakeup_sum[i] / rec->slot_events[i],
+			rec->request_sum[i] / rec->slot_events[i],
+			rec->rps_sum[i] / rec->slot_events[i],
+			rec->backlog_sum[i] / rec->slot_events[i]);
+		sep = 1;
+	}
+	fprintf(fp, "]");
 }
 
-unsigned long get_sys_tid(void)
+static void write_json_burst(FILE *fp)
 {
-	return syscall(SYS_gettid);
+	fprintf(fp, ", \"burst\": {\"period\": %.1f, \"requests\": %u, \"window_ms\": %.1f, ",
+		burst_period, burst_requests, burst_window_ms);
+	write_json_recovery(fp, &burst_recovery);
+	fprintf(fp, "}");
 }
 
-/*
- * spin or do some matrix arithmetic
- */
-static void do_work(struct thread_data *td)
+static void write_json_churn(FILE *fp)
 {
-	pthread_mutex_t *lock = NULL;
-	unsigned long i;
-	unsigned long ops_shared, ops_private;
-
-	/* using --calibrate or --no-locking skips the locks */
-	if (!skip_locking)
-		lock = lock_this_cpu();
-
-	/* Calculate operations split between shared and private data */
-	if (split_specified) {
-		ops_private = (operations * split_percent) / 100;
-		ops_shared = operations - ops_private;
+	fprintf(fp, ", \"churn\": {\"period\": %.1f, \"mode\": \"%s\", \"pct\": %d, ",
+		churn_period, churn_names[churn_mode], churn_pct);
+	write_json_recovery(fp, &churn_recovery);
+	fprintf(fp, "}");
+}
 
-		/* Do operations on shared data */
-		if (shared_matrix_size > 0 && ops_shared > 0) {
-			for (i = 0; i < ops_shared; i++)
-				do_some_math(shared_data, shared_matrix_size);
-		}
+static void write_json_antagonists(FILE *fp)
+{
+	struct antagonist *a;
+	int i;
 
-		/* Do operations on private data */
-		if (private_matrix_size > 0 && ops_private > 0) {
-			for (i = 0; i < ops_private; i++)
-				do_some_math(td->data, private_matrix_size);
-		}
-	} else {
-		/* Legacy behavior: if no split specified, use old matrix_size */
-		for (i = 0; i < operations; i++)
-			do_some_math(td->data, matrix_size);
+	fprintf(fp, ", \"antagonists\": [");
+	for (i = 0; i < nr_antagonists; i++) {
+		a = antagonists + i;
+		fprintf(fp,
+			"%s{\"type\": \"%s\", \"count\": %d, \"policy\": \"%s\", "
+			"\"nice\": %d, \"unit\": \"%s\", \"rate\": %.2f, "
+			"\"solo_rate\": %.2f}",
+			i ? ", " : "", antag_names[a->type], a->count,
+			antag_policy_name(a), a->nice, antag_units[a->type],
+			antag_rate(a->ops, a->run_ns, a->type), a->solo_rate);
 	}
-
-	if (!skip_locking)
-		pthread_mutex_unlock(lock);
+	fprintf(fp, "]");
 }
 
 /*
- * the worker thread is pretty simple, it just does a single spin and
- * then waits on a message from the message thread
+ * how evenly the loops were spread over nr workers or groups.  Jain's
+ * index is 1 when they all did the same work and 1/nr when one did all
+ * of it, min_max is the least busy over the most busy
  */
-void *worker_thread(void *arg)
+static void fairness_index(struct fair_stats *fs, int nr, double *jain,
+			   double *min_max)
 {
-	struct thread_data *td = arg;
-	struct timeval now;
-	struct timeval work_start;
-	struct timeval start;
-	unsigned long long delta;
-	struct request *req = NULL;
-	int ret;
-
-	td->sys_tid = get_sys_tid();
+	double sum = 0;
+	double sum_sq = 0;
+	double min = -1;
+	double max = 0;
+	double x;
+	int i;
 
-	ret = pthread_setname_np(pthread_self(), "schbench-worker");
-	if (ret) {
-		perror("failed to set worker thread name");
-		exit(1);
+	for (i = 0; i < nr; i++) {
+		x = fs[i].loops;
+		sum += x;
+		sum_sq += x * x;
+		if (min < 0 || x < min)
+			min = x;
+		if (x > max)
+			max = x;
 	}
-	gettimeofday(&start, NULL);
-	while(1) {
-		if (stopping)
-			break;
-
-		req = msg_and_wait(td);
-		if (requests_per_sec && !req)
-			continue;
-
-		do {
-			struct request *tmp;
-
-			if (pipe_test) {
-				gettimeofday(&work_start, NULL);
-			} else {
-				if (calibrate_only) {
-					/*
-					 * in calibration mode, don't include the
-					 * usleep in the timing
-					 */
-					if (sleep_usec > 0)
-						usleep(sleep_usec);
-					gettimeofday(&work_start, NULL);
-				} else {
-					/*
-					 * lets start off with some simulated networking,
-					 * and also make sure we get a fresh clean timeslice
-					 */
-					gettimeofday(&work_start, NULL);
-					if (sleep_usec > 0)
-						usleep(sleep_usec);
-				}
-				do_work(td);
-			}
-
-			gettimeofday(&now, NULL);
+	*jain = sum_sq ? sum * sum / (nr * sum_sq) : 1;
+	*min_max = max ? min / max : 1;
+}
 
-			td->runtime = tvdelta(&start, &now);
-			if (req) {
-				tmp = req->next;
-				free(req);
-				req = tmp;
-			}
-			td->loop_count++;
+/* index of the entry with the highest p99 */
+static int fairness_worst(struct fair_stats *fs, int nr, int request)
+{
+	unsigned int p99;
+	unsigned int worst_p99 = 0;
+	int worst = 0;
+	int i;
 
-			delta = tvdelta(&work_start, &now);
-			if (delta > 0)
-				add_lat(&td->request_stats, delta);
-		} while (req);
+	for (i = 0; i < nr; i++) {
+		p99 = stats_percentile(request ? &fs[i].request : &fs[i].wakeup,
+				       99);
+		if (p99 > worst_p99) {
+			worst_p99 = p99;
+			worst = i;
+		}
 	}
-	gettimeofday(&now, NULL);
-	td->runtime = tvdelta(&start, &now);
+	return worst;
+}
 
-	return NULL;
+static void show_fairness_line(char *label, struct fair_stats *fs, int nr)
+{
+	double jain;
+	double min_max;
+	int wake;
+	int req;
+
+	fairness_index(fs, nr, &jain, &min_max);
+	wake = fairness_worst(fs, nr, 0);
+	req = fairness_worst(fs, nr, 1);
+	fprintf(stderr, "fairness %s: jain %.3f min/max %.3f worst p99 wakeup %u (%d)",
+		label, jain, min_max, stats_percentile(&fs[wake].wakeup, 99),
+		wake);
+	if (!pipe_test)
+		fprintf(stderr, " request %u (%d)",
+			stats_percentile(&fs[req].request, 99), req);
+	fprintf(stderr, "\n");
 }
 
-int find_nth_set_bit(const cpu_set_t *set, int n)
+static void show_fairness(void)
 {
-	int count = 0;
-	for (int i = 0; i < CPU_SETSIZE; ++i) {
-		if (CPU_ISSET(i, set)) {
-			if (count == n)
-				return i; // Return the CPU index of the n’th set bit
-			++count;
-		}
-	}
-	return -1; // Not found
+	show_fairness_line("workers", fair_workers,
+			   message_threads * worker_threads);
+	show_fairness_line("groups", fair_groups, message_threads);
 }
 
-static void pin_message_cpu(int index, cpu_set_t *possible_cpus)
+static void write_json_fairness_summary(FILE *fp, char *label,
+					struct fair_stats *fs, int nr)
 {
-	cpu_set_t cpuset;
-	int ret;
-	CPU_ZERO(&cpuset);
-	int num_possible = CPU_COUNT(possible_cpus);
-	int cpu_to_set = index % num_possible;
+	double jain;
+	double min_max;
+	int wake;
+	int req;
+
+	fairness_index(fs, nr, &jain, &min_max);
+	wake = fairness_worst(fs, nr, 0);
+	req = fairness_worst(fs, nr, 1);
+	fprintf(fp, "\"%s\": {\"jain\": %.4f, \"min_max\": %.4f, "
+		"\"worst_wakeup_p99\": %u, \"worst_wakeup\": %d",
+		label, jain, min_max, stats_percentile(&fs[wake].wakeup, 99),
+		wake);
+	if (!pipe_test)
+		fprintf(fp, ", \"worst_request_p99\": %u, \"worst_request\": %d",
+			stats_percentile(&fs[req].request, 99), req);
+	fprintf(fp, "}");
+}
 
-	cpu_to_set = find_nth_set_bit(possible_cpus, cpu_to_set);
-	CPU_SET(cpu_to_set, &cpuset); // Pin to CPU 0
+static void write_json_fairness_list(FILE *fp, char *label,
+				     struct fair_stats *fs, int nr)
+{
+	int i;
 
-	pthread_t thread = pthread_self();
-	ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
-	if (ret) {
-		fprintf(stderr, "unable to set CPU affinity to cpu %d\n", cpu_to_set);
-		exit(1);
+	fprintf(fp, "\"%s\": [", label);
+	for (i = 0; i < nr; i++) {
+		fprintf(fp, "%s{\"loops\": %llu, \"wakeup_p50\": %u, "
+			"\"wakeup_p99\": %u",
+			i ? ", " : "", fs[i].loops,
+			stats_percentile(&fs[i].wakeup, 50),
+			stats_percentile(&fs[i].wakeup, 99));
+		if (!pipe_test)
+			fprintf(fp, ", \"request_p50\": %u, \"request_p99\": %u",
+				stats_percentile(&fs[i].request, 50),
+				stats_percentile(&fs[i].request, 99));
+		fprintf(fp, "}");
 	}
-	fprintf(stderr, "Pinning to message thread index %d cpu %d\n", index, cpu_to_set);
+	fprintf(fp, "]");
 }
 
-static void pin_worker_cpus(cpu_set_t *worker_cpus)
+/* per_workers is ordered by group, worker_threads entries each */
+static void write_json_fairness(FILE *fp)
 {
-	int ret;
-	pthread_t thread = pthread_self();
-	ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), worker_cpus);
-	if (ret) {
-		fprintf(stderr, "unable to set CPU affinity\n");
-	}
+	int nr = message_threads * worker_threads;
+
+	fprintf(fp, ", \"fairness\": {");
+	write_json_fairness_summary(fp, "workers", fair_workers, nr);
+	fprintf(fp, ", ");
+	write_json_fairness_summary(fp, "groups", fair_groups, message_threads);
+	fprintf(fp, ", ");
+	write_json_fairness_list(fp, "per_worker", fair_workers, nr);
+	fprintf(fp, ", ");
+	write_json_fairness_list(fp, "per_group", fair_groups, message_threads);
+	fprintf(fp, "}");
+}
+
+static void write_json_footer(FILE *fp)
+{
+	fprintf(fp, "}");
+	if (slo_usec)
+		write_json_slo(fp);
+	if (report_dispatchers)
+		write_json_dispatchers(fp);
+	if (save_histograms)
+		write_json_histograms(fp);
+	if (baseline_file)
+		write_json_baseline(fp);
+	if (iterations > 1)
+		write_json_iterations(fp);
+	if (phases)
+		write_json_phases(fp);
+	if (burst_period)
+		write_json_burst(fp);
+	if (churn_period)
+		write_json_churn(fp);
+	if (nr_antagonists)
+		write_json_antagonists(fp);
+	if (fairness)
+		write_json_fairness(fp);
+	if (flight_usec)
+		fprintf(fp, ", \"flight_recorder\": {\"threshold\": %lu, "
+			"\"dumps\": %lu, \"dropped\": %lu}",
+			flight_usec, flight_dumps, flight_dropped);
+	fprintf(fp, "}");
+	fflush(fp);
 }
 
 /*
- * the message thread starts his own gaggle of workers and then sits around
- * replying when they post him.  He collects latency stats as all the threads
- * exit
+ * fold latency info from s into d.  Most histograms only use a handful
+ * of buckets, so we walk the used bitmap instead of all PLAT_NR
  */
-void *message_thread(void *arg)
+void combine_stats(struct stats *d, struct stats *s)
 {
-	struct thread_data *td = arg;
-	struct thread_data *worker_threads_mem = NULL;
-	int i;
-	int ret;
+	unsigned long bits;
+	unsigned int i;
+	unsigned int w;
 
-	ret = pthread_setname_np(pthread_self(), "schbench-msg");
-	if (ret) {
-		perror("failed to set message thread name");
-		exit(1);
+	for (w = 0; w < PLAT_USED_LONGS; w++) {
+		bits = s->used[w];
+		if (!bits)
+			continue;
+		d->used[w] |= bits;
+		while (bits) {
+			i = w * BITS_PER_LONG + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			d->plat[i] += s->plat[i];
+		}
 	}
-	worker_threads_mem = td + 1;
+	d->nr_samples += s->nr_samples;
+	if (s->max > d->max)
+		d->max = s->max;
+	if (d->min == 0 || s->min < d->min)
+		d->min = s->min;
+}
 
-	if (!worker_threads_mem) {
-		perror("unable to allocate ram");
-		pthread_exit((void *)-ENOMEM);
-	}
+/* record a latency result into the histogram */
+static void add_lat(struct stats *s, unsigned int us)
+{
+	int lat_index = 0;
 
-	td->sys_tid = get_sys_tid();
+	if (us > s->max)
+		s->max = us;
+	if (s->min == 0 || us < s->min)
+		s->min = us;
+
+	lat_index = plat_val_to_idx(us);
+	if (!__sync_fetch_and_add(&s->plat[lat_index], 1))
+		__sync_fetch_and_or(&s->used[lat_index / BITS_PER_LONG],
+				    1UL << (lat_index % BITS_PER_LONG));
+	__sync_fetch_and_add(&s->nr_samples, 1);
+}
+
+/* state for the -A controller */
+struct rps_controller {
+	double rps;
+	double last_err;
+	/* samples per busy window, and samples left before we act again */
+	int window;
+	int hold;
+	unsigned long long start_ns;
+	/* how long it took to converge, 0 if we haven't yet */
+	unsigned long long converged_ns;
+	int in_band;
+	unsigned long samples;
+	/* busy - target after converging, in percentage points */
+	unsigned long steady_samples;
+	double steady_abs_err;
+	double steady_err;
+};
+
+/* how the spin side of fwait_spin() worked out for one thread */
+struct spin_stats {
+	unsigned long long nr_waits;
+	unsigned long long nr_spin_hits;
+	unsigned long long spin_ns;
+	/* decaying average of how long our waits take, for adaptive spins */
+	unsigned long long avg_wait_ns;
+};
+
+struct request {
+	struct timeval start_time;
+	struct request *next;
+};
+
+#define CACHELINE_SIZE 64
+#define ____cacheline_aligned __attribute__((aligned(CACHELINE_SIZE)))
+
+/*
+ * every thread has one of these.  It's split into cachelines by who
+ * writes what: the setup fields are read mostly, the handoff line is
+ * shared between a worker and its waker, wake_gen is hammered by the
+ * message thread and the counters are only written by the thread
+ * itself.  The histograms and pipe buffer are allocated separately so
+ * this stays a few cachelines instead of megabytes.
+ */
+struct thread_data {
+	/* opaque pthread tid */
+	pthread_t tid;
+
+	/* actual tid from SYS_gettid */
+	unsigned long sys_tid;
+
+	/* used for pinning to CPUs etc, just a counter for which thread we are */
+	unsigned long index;
+
+	/* our parent thread and messaging partner */
+	struct thread_data *msg_thread;
+
+	/* where --pin wants us to run */
+	cpu_set_t *pin_cpus;
+
+	/* matrices to multiply */
+	unsigned long *data;
+
+	/* only allocated for workers in pipe mode, pipe_test bytes */
+	char *pipe_page;
+
+	/* mr axboe's magic latency histogram, workers only */
+	struct stats *wakeup_stats;
+	struct stats *request_stats;
+	/* wakeup latency by batch position, only allocated for --wake-mode */
+	struct stats *wake_pos_stats;
+	/* MB/s for each request, only allocated for the STREAM kernels */
+	struct stats *bw_stats;
+	/* wakeup latency by waker distance, only for --wakeup-topology */
+	struct stats *dist_stats;
+	/* how much longer than sleep_usec our sleeps took */
+	struct stats *sleep_stats;
+	/* request latency split into parts, only for --breakdown */
+	struct stats *breakdown_stats;
+
+	/* timerfd or epoll fd for --sleep-mode */
+	int sleep_fd;
+	/* nobody ever posts this, for --sleep-mode futex */
+	int sleep_futex;
+	/* /proc/<tid>/schedstat, kept open by the reporter */
+	int schedstat_fd;
+
+	/*
+	 * the msg thread stuffs gtod in here before waking us, so we can
+	 * measure scheduler latency
+	 */
+	struct timeval wake_time ____cacheline_aligned;
+
+	/* keep the futex and the wake_time in the same cacheline */
+	int futex;
+
+	/* our slot in the waker's batch, see --wake-mode */
+	unsigned int wake_pos;
+
+	/* the CPU our waker was on, for --wakeup-topology */
+	int wake_cpu;
+
+	/* ->next is for placing us on the msg_thread's list for waking */
+	struct thread_data *next;
+
+	/* ->request is all of our pending request */
+	struct request *request;
+	unsigned int pending;
+	/* the most pending requests we've had since --burst last cleared it */
+	unsigned int peak_pending;
+
+	/* message threads bump this for --wake-mode shared and waitv */
+	int wake_gen ____cacheline_aligned;
+
+	/* the CPU we were on when we went to sleep */
+	int cpu ____cacheline_aligned;
+	unsigned long long avg_sched_delay;
+	unsigned long long loop_count;
+	unsigned long long runtime;
+
+	/* --worker-spin and --msg-spin accounting */
+	struct spin_stats spin;
+
+	/* recent events, only allocated for --flight-recorder */
+	struct flight_ring *flight;
+};
+
+/*
+ * --flight-recorder.  Each worker has a ring of its most recent events,
+ * written by the worker and by whoever wakes it, so slots are claimed
+ * with an atomic add.  Recording is a few stores, the expensive part
+ * only happens when something was slow enough to dump.
+ */
+#define FLIGHT_EVENTS 256	/* must be a power of two */
+/* dumps after this many are only counted */
+#define FLIGHT_MAX_DUMPS 64
+
+enum {
+	FL_WAKE_POSTED = 0,	/* arg is the batch position */
+	FL_QUEUED,		/* arg is how many requests are pending */
+	FL_BLOCK,
+	FL_WAKEUP,		/* arg is the wakeup latency */
+	FL_LOCK,		/* arg is how long we waited for the lock */
+	FL_DONE,		/* arg is the request latency */
+};
+static char *flight_event_names[] = { "wake posted", "queued", "block",
+				      "wakeup", "lock", "done" };
+
+struct flight_event {
+	unsigned long long ns;
+	unsigned int arg;
+	short cpu;
+	unsigned short type;
+};
+
+struct flight_ring {
+	unsigned long head;
+	struct flight_event events[FLIGHT_EVENTS];
+};
+
+static void flight_record(struct thread_data *td, int type, unsigned int arg)
+{
+	struct flight_event *ev;
+	unsigned long slot;
+
+	if (!td->flight)
+		return;
+	slot = __sync_fetch_and_add(&td->flight->head, 1);
+	ev = td->flight->events + (slot & (FLIGHT_EVENTS - 1));
+	ev->ns = nsec_now();
+	ev->arg = arg;
+	ev->cpu = sched_getcpu();
+	ev->type = type;
+}
+
+struct flight_dump_event {
+	struct flight_event ev;
+	int worker;
+};
+
+/* one slow event, waiting for the reporter to write it out */
+struct flight_dump {
+	struct flight_dump *next;
+	unsigned long long ns;
+	unsigned long long latency;
+	int type;
+	int worker;
+	int nr;
+	struct flight_dump_event events[];
+};
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flight_dump *flight_head = NULL;
+static struct flight_dump **flight_tail = &flight_head;
+static unsigned long long flight_start_ns;
+static FILE *flight_fp = NULL;
+
+static int flight_worker_nr(struct thread_data *td)
+{
+	return td->msg_thread->index * worker_threads + td->index;
+}
+
+static int cmp_flight_event(const void *a, const void *b)
+{
+	const struct flight_dump_event *ea = a;
+	const struct flight_dump_event *eb = b;
+
+	if (ea->ev.ns < eb->ev.ns)
+		return -1;
+	return ea->ev.ns > eb->ev.ns;
+}
+
+/*
+ * td just saw a slow wakeup or request.  Copy out its ring, and whatever
+ * the other workers in its group did over the same stretch of time, and
+ * queue it for the reporter.  Nothing here touches the file
+ */
+static void flight_dump(struct thread_data *td, int type,
+			unsigned long long latency)
+{
+	struct thread_data *worker = td->msg_thread + 1;
+	struct flight_dump *dump;
+	struct flight_event *ev;
+	unsigned long long now = nsec_now();
+	unsigned long long oldest = now;
+	int i;
+	int j;
+
+	pthread_mutex_lock(&flight_lock);
+	if (flight_dumps >= FLIGHT_MAX_DUMPS) {
+		flight_dropped++;
+		pthread_mutex_unlock(&flight_lock);
+		return;
+	}
+	flight_dumps++;
+	pthread_mutex_unlock(&flight_lock);
+
+	dump = malloc(sizeof(*dump) + sizeof(dump->events[0]) *
+		      worker_threads * FLIGHT_EVENTS);
+	if (!dump) {
+		perror("unable to allocate flight dump");
+		exit(1);
+	}
+	dump->next = NULL;
+	dump->ns = now;
+	dump->latency = latency;
+	dump->type = type;
+	dump->worker = flight_worker_nr(td);
+	dump->nr = 0;
+
+	/* our own ring decides how far back the window goes */
+	for (i = 0; i < FLIGHT_EVENTS; i++) {
+		ev = td->flight->events + i;
+		if (ev->ns && ev->ns < oldest)
+			oldest = ev->ns;
+	}
+	for (i = 0; i < worker_threads; i++) {
+		for (j = 0; j < FLIGHT_EVENTS; j++) {
+			ev = worker[i].flight->events + j;
+			if (ev->ns < oldest || ev->ns > now)
+				continue;
+			dump->events[dump->nr].ev = *ev;
+			dump->events[dump->nr].worker = flight_worker_nr(worker + i);
+			dump->nr++;
+		}
+	}
+	qsort(dump->events, dump->nr, sizeof(dump->events[0]),
+	      cmp_flight_event);
+
+	pthread_mutex_lock(&flight_lock);
+	*flight_tail = dump;
+	flight_tail = &dump->next;
+	pthread_mutex_unlock(&flight_lock);
+}
+
+/* called by the reporter, write out anything the workers queued up */
+static void flush_flight_dumps(void)
+{
+	struct flight_dump *dump;
+	struct flight_dump_event *fe;
+	int i;
+
+	pthread_mutex_lock(&flight_lock);
+	dump = flight_head;
+	flight_head = NULL;
+	flight_tail = &flight_head;
+	pthread_mutex_unlock(&flight_lock);
+
+	while (dump) {
+		struct flight_dump *next = dump->next;
+
+		fprintf(flight_fp, "slow %s %llu usec on worker %d at %.6f s\n",
+			dump->type == FL_WAKEUP ? "wakeup" : "request",
+			dump->latency, dump->worker,
+			(double)(dump->ns - flight_start_ns) / NSEC_PER_SEC);
+		fprintf(flight_fp, "%12s %6s %4s  %s\n", "usec", "worker", "cpu",
+			"event");
+		for (i = 0; i < dump->nr; i++) {
+			fe = dump->events + i;
+			fprintf(flight_fp, "%12.1f %6d %4d  %s",
+				-(double)(dump->ns - fe->ev.ns) / 1000,
+				fe->worker, fe->ev.cpu,
+				flight_event_names[fe->ev.type]);
+			if (fe->ev.type != FL_BLOCK)
+				fprintf(flight_fp, " %u", fe->ev.arg);
+			fprintf(flight_fp, "\n");
+		}
+		fprintf(flight_fp, "\n");
+		free(dump);
+		dump = next;
+	}
+	fflush(flight_fp);
+}
+
+/* thread_data has cacheline aligned members, calloc isn't enough */
+static struct thread_data *alloc_thread_data(int nr)
+{
+	struct thread_data *td;
+	size_t size = (size_t)nr * sizeof(*td);
+
+	if (posix_memalign((void **)&td, CACHELINE_SIZE, size))
+		return NULL;
+	memset(td, 0, size);
+	return td;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define nop __asm__ __volatile__("rep;nop": : :"memory")
+#elif defined(__aarch64__)
+#define nop __asm__ __volatile__("yield" ::: "memory")
+#elif defined(__powerpc64__) || defined(__s390__)
+#define nop __asm__ __volatile__("nop": : :"memory")
+#elif defined(__riscv)
+#define nop __asm__ __volatile__("nop": : :"memory")
+#else
+#error Unsupported architecture
+#endif
+
+/* we're so fancy we make our own futex wrappers */
+#define FUTEX_BLOCKED 0
+#define FUTEX_RUNNING 1
+
+static int futex(int *uaddr, int futex_op, int val,
+		 const struct timespec *timeout, int *uaddr2, int val3)
+{
+	return syscall(SYS_futex, uaddr, futex_op, val, timeout, uaddr2, val3);
+}
+
+/* futex2, older headers don't have these */
+#ifndef __NR_futex_waitv
+#define __NR_futex_waitv 449
+#endif
+#ifndef FUTEX_32
+#define FUTEX_32 2
+#endif
+
+struct waitv {
+	unsigned long long val;
+	unsigned long long uaddr;
+	unsigned int flags;
+	unsigned int __reserved;
+};
+
+/*
+ * wait until either futex is changed and woken.  Returns -1 with errno
+ * set just like the futex syscall
+ */
+static int futex_waitv2(int *uaddr1, int val1, int *uaddr2, int val2)
+{
+	struct waitv waiters[2];
+
+	memset(waiters, 0, sizeof(waiters));
+	waiters[0].val = val1;
+	waiters[0].uaddr = (unsigned long)uaddr1;
+	waiters[0].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+	waiters[1].val = val2;
+	waiters[1].uaddr = (unsigned long)uaddr2;
+	waiters[1].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+
+	return syscall(__NR_futex_waitv, waiters, 2, 0, NULL, CLOCK_MONOTONIC);
+}
+
+/*
+ * wakeup a process waiting on a futex, making sure they are really waiting
+ * first
+ */
+static void fpost(int *futexp)
+{
+	int s;
+
+	if (__sync_bool_compare_and_swap(futexp, FUTEX_BLOCKED,
+					 FUTEX_RUNNING)) {
+		s = futex(futexp, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		if (s  == -1) {
+			perror("FUTEX_WAKE");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * wait on a futex, with an optional timeout.  Make sure to set
+ * the futex to FUTEX_BLOCKED beforehand.
+ *
+ * This will return zero if all went well, or return -ETIMEDOUT if you
+ * hit the timeout without getting posted
+ */
+static int fwait(int *futexp, struct timespec *timeout)
+{
+	int s;
+	while (1) {
+		/* Is the futex available? */
+		if (__sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
+						 FUTEX_BLOCKED)) {
+			break;      /* Yes */
+		}
+		/* Futex is not available; wait */
+		s = futex(futexp, FUTEX_WAIT_PRIVATE, FUTEX_BLOCKED, timeout, NULL, 0);
+		if (s == -1 && errno != EAGAIN) {
+			if (errno == ETIMEDOUT)
+				return -ETIMEDOUT;
+			perror("futex-FUTEX_WAIT");
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+/*
+ * --wake-mode shared and waitv.  The message thread flips our futex to
+ * FUTEX_RUNNING and then bumps *genp, so we have to sample gen before
+ * putting ourselves on the list and check the futex after every wakeup.
+ */
+static void fwait_gen(int *futexp, int *genp, int gen)
+{
+	int s;
+
+	while (1) {
+		if (__sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
+						 FUTEX_BLOCKED))
+			break;
+		if (wake_mode == WAKE_WAITV)
+			s = futex_waitv2(futexp, FUTEX_BLOCKED, genp, gen);
+		else
+			s = futex(genp, FUTEX_WAIT_PRIVATE, gen, NULL, NULL, 0);
+		if (s == -1 && errno != EAGAIN && errno != EINTR) {
+			perror(wake_mode == WAKE_WAITV ? "futex_waitv" :
+			       "futex-FUTEX_WAIT");
+			exit(1);
+		}
+		gen = *(volatile int *)genp;
+	}
+}
+
+/*
+ * wake everyone sleeping on the group's shared futex word.  We can't
+ * use the batch size as the wake count here: a worker that queued itself
+ * after the splice may be sleeping on the word too, and if it soaks up
+ * one of the wakeups someone from the batch is left sleeping on a stale
+ * generation.  The extra waiters just recheck their futex and go back
+ * to sleep.
+ */
+static void wake_gen_all(int *genp)
+{
+	__sync_fetch_and_add(genp, 1);
+	if (futex(genp, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0) == -1) {
+		perror("FUTEX_WAKE");
+		exit(1);
+	}
+}
+
+/*
+ * spin on the futex for a while before going to sleep, returns 1 if
+ * we got posted while spinning
+ */
+static int fspin(int *futexp, struct spin_policy *policy,
+		 struct spin_stats *ss, unsigned long long start)
+{
+	unsigned long long budget = policy->ns;
+	unsigned long long now = start;
+	int hit = 0;
+
+	if (policy->adaptive) {
+		/*
+		 * if waits are usually longer than the cap, spinning is
+		 * just burning CPU.  Otherwise spin a bit past the average
+		 */
+		if (ss->avg_wait_ns > policy->max_ns)
+			budget = 0;
+		else
+			budget = ss->avg_wait_ns * 2;
+		if (budget > policy->max_ns)
+			budget = policy->max_ns;
+	}
+
+	while (now - start < budget) {
+		if (*(volatile int *)futexp == FUTEX_RUNNING &&
+		    __sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
+						 FUTEX_BLOCKED)) {
+			hit = 1;
+			break;
+		}
+		nop;
+		now = nsec_now();
+	}
+	if (budget) {
+		ss->spin_ns += nsec_now() - start;
+		ss->nr_spin_hits += hit;
+	}
+	return hit;
+}
+
+/*
+ * fwait() or fwait_gen() with an optional spin first.  If genp is
+ * NULL we use fwait()
+ */
+static void fwait_spin(int *futexp, int *genp, int gen,
+		       struct spin_policy *policy, struct spin_stats *ss)
+{
+	unsigned long long start;
+	unsigned long long wait_ns;
+
+	if (!policy->ns && !policy->adaptive) {
+		if (genp)
+			fwait_gen(futexp, genp, gen);
+		else
+			fwait(futexp, NULL);
+		return;
+	}
+
+	start = nsec_now();
+	if (!fspin(futexp, policy, ss, start)) {
+		if (genp)
+			fwait_gen(futexp, genp, gen);
+		else
+			fwait(futexp, NULL);
+	}
+	wait_ns = nsec_now() - start;
+	ss->nr_waits++;
+	ss->avg_wait_ns = ss->avg_wait_ns - ss->avg_wait_ns / 8 + wait_ns / 8;
+}
+
+/*
+ * cmpxchg based list prepend
+ */
+static void xlist_add(struct thread_data *head, struct thread_data *add)
+{
+	struct thread_data *old;
+	struct thread_data *ret;
+
+	while (1) {
+		old = head->next;
+		add->next = old;
+		ret = __sync_val_compare_and_swap(&head->next, old, add);
+		if (ret == old)
+			break;
+	}
+}
+
+/*
+ * xchg based list splicing.  This returns the entire list and
+ * replaces the head->next with NULL
+ */
+static struct thread_data *xlist_splice(struct thread_data *head)
+{
+	struct thread_data *old;
+	struct thread_data *ret;
+
+	while (1) {
+		old = head->next;
+		ret = __sync_val_compare_and_swap(&head->next, old, NULL);
+		if (ret == old)
+			break;
+	}
+	return ret;
+}
+
+/*
+ * cmpxchg based list prepend
+ */
+static struct request *request_add(struct thread_data *head, struct request *add)
+{
+	struct request *old;
+	struct request *ret;
+
+	while (1) {
+		old = head->request;
+		add->next = old;
+		ret = __sync_val_compare_and_swap(&head->request, old, add);
+		if (ret == old)
+			return old;
+	}
+}
+
+/*
+ * xchg based list splicing.  This returns the entire list and
+ * replaces the head->request with NULL.  The list is reversed before
+ * returning
+ */
+static struct request *request_splice(struct thread_data *head)
+{
+	struct request *old;
+	struct request *ret;
+	struct request *reverse = NULL;
+
+	while (1) {
+		old = head->request;
+		ret = __sync_val_compare_and_swap(&head->request, old, NULL);
+		if (ret == old)
+			break;
+	}
+
+	while(ret) {
+		struct request *tmp = ret;
+		ret = ret->next;
+		tmp->next = reverse;
+		reverse = tmp;
+	}
+	return reverse;
+}
+
+static struct request *allocate_request(void)
+{
+	struct request *ret = malloc(sizeof(*ret));
+
+	if (!ret) {
+		perror("malloc");
+		exit(1);
+	}
+
+	gettimeofday(&ret->start_time, NULL);
+	ret->next = NULL;
+	return ret;
+}
+
+
+/* how far apart two CPUs are, for --wakeup-topology */
+static int cpu_distance(int a, int b)
+{
+	if (a < 0 || b < 0 || a >= CPU_SETSIZE || b >= CPU_SETSIZE)
+		return DIST_REMOTE;
+	if (a == b)
+		return DIST_SAME_CPU;
+	if (cpu_topo[a].core == cpu_topo[b].core &&
+	    cpu_topo[a].package == cpu_topo[b].package)
+		return DIST_SMT;
+	if (cpu_topo[a].llc == cpu_topo[b].llc)
+		return DIST_LLC;
+	if (cpu_topo[a].node == cpu_topo[b].node)
+		return DIST_NODE;
+	return DIST_REMOTE;
+}
+
+/* one helper per LLC for --wake-mode helper */
+static struct thread_data *wake_helpers = NULL;
+
+/*
+ * workers, message threads, dispatchers and main all wait here once
+ * they're set up, so nobody starts the load until everyone is ready
+ */
+static pthread_barrier_t start_barrier;
+/* --stack-size for all the threads we make */
+static pthread_attr_t thread_attr;
+
+/*
+ * fill in the wake_time for a worker we're about to wake.  Since pipe
+ * mode ends up measuring this other ways, we do the gtod every time in
+ * pipe mode
+ */
+static void prep_wakeup(struct thread_data *worker, struct timeval *now,
+			unsigned int pos, int cpu)
+{
+	if (pipe_test) {
+		memset(worker->pipe_page, 1, pipe_test);
+		gettimeofday(&worker->wake_time, NULL);
+	} else {
+		memcpy(&worker->wake_time, now, sizeof(*now));
+	}
+	worker->wake_pos = pos;
+	worker->wake_cpu = cpu;
+	flight_record(worker, FL_WAKE_POSTED, pos);
+}
+
+/*
+ * --wake-mode shared and waitv, flip everyone to running and then
+ * wake the whole batch with one syscall
+ */
+static void xlist_wake_shared(struct thread_data *td, struct thread_data *list,
+			      struct timeval *now, int cpu)
+{
+	struct thread_data *next;
+	unsigned int pos = 0;
+
+	while (list) {
+		next = list->next;
+		list->next = NULL;
+		prep_wakeup(list, now, pos++, cpu);
+		__sync_bool_compare_and_swap(&list->futex, FUTEX_BLOCKED,
+					     FUTEX_RUNNING);
+		list = next;
+	}
+	if (pos)
+		wake_gen_all(&td->wake_gen);
+}
+
+/*
+ * --wake-mode percpu, only wake one worker for each CPU they went to sleep
+ * on.  Everyone else goes back on the list for the next pass, which
+ * happens as soon as one of the workers we did wake posts us.
+ */
+static void xlist_wake_percpu(struct thread_data *td, struct thread_data *list,
+			      struct timeval *now, int cpu)
+{
+	struct thread_data *next;
+	struct thread_data *deferred = NULL;
+	cpu_set_t woken;
+	unsigned int pos = 0;
+
+	CPU_ZERO(&woken);
+	while (list) {
+		next = list->next;
+		/*
+		 * nobody wakes deferred workers properly once we're stopping,
+		 * so the last pass takes everyone
+		 */
+		if (list->cpu >= 0 && list->cpu < CPU_SETSIZE && !stopping) {
+			if (CPU_ISSET(list->cpu, &woken)) {
+				list->next = deferred;
+				deferred = list;
+				list = next;
+				continue;
+			}
+			CPU_SET(list->cpu, &woken);
+		}
+		list->next = NULL;
+		prep_wakeup(list, now, pos++, cpu);
+		fpost(&list->futex);
+		list = next;
+	}
+	while (deferred) {
+		next = deferred->next;
+		xlist_add(td, deferred);
+		deferred = next;
+	}
+}
+
+/*
+ * --wake-mode helper, stamp the wake_time and then hand each worker to
+ * the helper for the LLC it went to sleep in
+ */
+static void xlist_wake_helper(struct thread_data *list, struct timeval *now,
+			      int cpu)
+{
+	struct thread_data *next;
+	cpu_set_t kicked;
+	int llc;
+
+	CPU_ZERO(&kicked);
+	while (list) {
+		next = list->next;
+		prep_wakeup(list, now, 0, cpu);
+		llc = 0;
+		if (list->cpu >= 0 && list->cpu < CPU_SETSIZE)
+			llc = cpu_topo[list->cpu].llc;
+		xlist_add(wake_helpers + llc, list);
+		CPU_SET(llc, &kicked);
+		list = next;
+	}
+	for (llc = 0; llc < nr_llc; llc++) {
+		if (CPU_ISSET(llc, &kicked))
+			fpost(&wake_helpers[llc].futex);
+	}
+}
+
+/*
+ * Wake everyone currently waiting on the message list, filling in their
+ * thread_data->wake_time with the current time.
+ *
+ * It's not exactly the current time, it's really the time at the start of
+ * the list run.  We want to detect when the scheduler is just preempting the
+ * waker and giving away the rest of its timeslice.  So we gtod once at
+ * the start of the loop and use that for all the threads we wake.
+ */
+static void xlist_wake_all(struct thread_data *td)
+{
+	struct thread_data *list;
+	struct thread_data *next;
+	struct timeval now;
+	unsigned int pos = 0;
+	int cpu = -1;
+
+	list = xlist_splice(td);
+	gettimeofday(&now, NULL);
+	if (wakeup_topology)
+		cpu = sched_getcpu();
+
+	switch (wake_mode) {
+	case WAKE_SHARED:
+	case WAKE_WAITV:
+		xlist_wake_shared(td, list, &now, cpu);
+		return;
+	case WAKE_PERCPU:
+		xlist_wake_percpu(td, list, &now, cpu);
+		return;
+	case WAKE_HELPER:
+		xlist_wake_helper(list, &now, cpu);
+		return;
+	}
+
+	while (list) {
+		next = list->next;
+		list->next = NULL;
+		prep_wakeup(list, &now, pos++, cpu);
+		fpost(&list->futex);
+		list = next;
+	}
+}
+
+/*
+ * the helper side of --wake-mode helper.  The wake_time was already
+ * filled in by the message thread, we just do the FUTEX_WAKEs
+ */
+static void helper_wake_all(struct thread_data *td)
+{
+	struct thread_data *list;
+	struct thread_data *next;
+	unsigned int pos = 0;
+	int cpu = -1;
+
+	list = xlist_splice(td);
+	if (list && wakeup_topology)
+		cpu = sched_getcpu();
+	while (list) {
+		next = list->next;
+		list->next = NULL;
+		list->wake_pos = pos++;
+		/* we're the one the scheduler sees doing the wakeup */
+		list->wake_cpu = cpu;
+		fpost(&list->futex);
+		list = next;
+	}
+}
+
+/*
+ * called by worker threads to send a message and wait for the answer.
+ * In reality we're just trading one cacheline with the gtod and futex in
+ * it, but that's good enough.  We gtod after waking and use that to
+ * record scheduler latency.
+ */
+static struct request *msg_and_wait(struct thread_data *td)
+{
+	struct request *req;
+	struct timeval now;
+	unsigned long long delta;
+	int gen = 0;
+
+	if (pipe_test)
+		memset(td->pipe_page, 2, pipe_test);
+
+	/* set ourselves to blocked */
+	td->futex = FUTEX_BLOCKED;
+	gettimeofday(&td->wake_time, NULL);
+	if (wake_mode == WAKE_PERCPU || wake_mode == WAKE_HELPER)
+		td->cpu = sched_getcpu();
+
+	/* add us to the list */
+	if (requests_per_sec) {
+		td->pending = 0;
+		req = request_splice(td);
+		if (req) {
+			td->futex = FUTEX_RUNNING;
+			return req;
+		}
+	} else {
+		gen = *(volatile int *)&td->msg_thread->wake_gen;
+		xlist_add(td->msg_thread, td);
+	}
+
+	fpost(&td->msg_thread->futex);
+	flight_record(td, FL_BLOCK, 0);
+
+	/*
+	 * don't wait if the main threads are shutting down,
+	 * they will never kick us fpost has a full barrier, so as long
+	 * as the message thread walks his list after setting stopping,
+	 * we shouldn't miss the wakeup
+	 */
+	if (!stopping) {
+		/* if he hasn't already woken us up, wait */
+		if (!requests_per_sec &&
+		    (wake_mode == WAKE_SHARED || wake_mode == WAKE_WAITV))
+			fwait_spin(&td->futex, &td->msg_thread->wake_gen, gen,
+				   &worker_spin, &td->spin);
+		else
+			fwait_spin(&td->futex, NULL, 0, &worker_spin,
+				   &td->spin);
+	}
+	gettimeofday(&now, NULL);
+	delta = tvdelta(&td->wake_time, &now);
+	if (delta > 0) {
+		add_lat(td->wakeup_stats, delta);
+		if (td->wake_pos_stats && !requests_per_sec)
+			add_lat(td->wake_pos_stats +
+				wake_pos_bucket(td->wake_pos), delta);
+		if (td->dist_stats)
+			add_lat(td->dist_stats +
+				cpu_distance(td->wake_cpu, sched_getcpu()),
+				delta);
+	}
+	if (td->flight) {
+		flight_record(td, FL_WAKEUP, delta);
+		if (delta >= flight_usec)
+			flight_dump(td, FL_WAKEUP, delta);
+	}
+
+	return NULL;
+}
+
+/* cpu lines come first in /proc/stat, this is plenty for them */
+#define PROC_STAT_BUF (256 * 1024)
+
+/*
+ * read /proc/stat, return the percentage of non-idle time since
+ * the last read.  With cpus == NULL we use the summary line, otherwise
+ * we add up the cpuN lines for the CPUs in the set.  Returns -1 if no
+ * time has gone by since the last read
+ */
+float read_busy(int fd, char *buf, int len, cpu_set_t *cpus,
+		unsigned long long *total_time_ret,
+		unsigned long long *idle_time_ret)
+{
+	unsigned long long total_time = 0;
+	unsigned long long idle_time = 0;
+	unsigned long long delta;
+	unsigned long long delta_idle;
+	unsigned long long val;
+	int found = 0;
+	int ret;
+	int pos = 0;
+	char *line;
+	char *c;
+	char *save = NULL;
+	char *line_save = NULL;
+
+	ret = lseek(fd, 0, SEEK_SET);
+	if (ret < 0) {
+		perror("lseek");
+		exit(1);
+	}
+	while (pos < len - 1) {
+		ret = read(fd, buf + pos, len - 1 - pos);
+		if (ret < 0) {
+			perror("failed to read /proc/stat");
+			exit(1);
+		}
+		if (ret == 0)
+			break;
+		pos += ret;
+	}
+	buf[pos] = '\0';
+
+	/* cpu  590315893 45841886 375984879 82585100131 166708940 0 5453892 0 0 0 */
+	for (line = strtok_r(buf, "\n", &line_save); line;
+	     line = strtok_r(NULL, "\n", &line_save)) {
+		int col = 1;
+
+		if (strncmp(line, "cpu", 3))
+			break;
+		c = strtok_r(line, " ", &save);
+		if (cpus) {
+			int cpu;
+
+			if (!strcmp(c, "cpu"))
+				continue;
+			cpu = atoi(c + 3);
+			if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, cpus))
+				continue;
+		} else if (strcmp(c, "cpu") != 0) {
+			break;
+		}
+		found = 1;
+
+		while (c != NULL) {
+			c = strtok_r(NULL, " ", &save);
+			if (!c)
+				break;
+			val = atoll(c);
+			if (col++ == 4)
+				idle_time += val;
+			total_time += val;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "unable to parse /proc/stat\n");
+		exit(1);
+	}
+
+	if (*total_time_ret == 0) {
+		*total_time_ret = total_time;
+		*idle_time_ret = idle_time;
+		return 0.0;
+	}
+
+	/* delta is the total time spent doing everything */
+	delta = total_time - *total_time_ret;
+	delta_idle = idle_time - *idle_time_ret;
+	if (delta == 0)
+		return -1;
+
+	*total_time_ret = total_time;
+	*idle_time_ret = idle_time;
+
+	return 100.00 - ((float)delta_idle/(float)delta) * 100.00;
+}
+
+/* set once we run out of fds, after that we open schedstat every time */
+static int schedstat_no_cache = 0;
+
+/*
+ * read the schedstats for a thread and return the average scheduling delay
+ * in nanoseconds.  We keep the file open in td->schedstat_fd so each
+ * interval is one pread per thread instead of a fopen/fscanf/fclose
+ */
+unsigned long long read_sched_delay(struct thread_data *td)
+{
+	unsigned long long runqueue_ns = 0;
+	unsigned long long nr_scheduled = 0;
+	char path[96];
+	char buf[128];
+	char *p;
+	int fd = td->schedstat_fd;
+	int ret;
+
+	if (fd < 0) {
+		snprintf(path, sizeof(path), "/proc/%lu/schedstat", td->sys_tid);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE)
+				schedstat_no_cache = 1;
+			/* this can happen during final stats print at exit */
+			return 0;
+		}
+		if (!schedstat_no_cache)
+			td->schedstat_fd = fd;
+	}
+
+	ret = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (td->schedstat_fd != fd)
+		close(fd);
+	/* the thread is gone, this can happen at exit too */
+	if (ret <= 0)
+		return 0;
+	buf[ret] = '\0';
+
+	/*
+	 * proc_pid_schedstat() in the kernel prints:
+	 * runtime, delay, pcount
+	 */
+	strtoull(buf, &p, 10);
+	runqueue_ns = strtoull(p, &p, 10);
+	nr_scheduled = strtoull(p, &p, 10);
+	if (p == buf) {
+		fprintf(stderr, "Failed to parse /proc/%lu/schedstat\n",
+			td->sys_tid);
+		exit(1);
+	}
+
+	if (!nr_scheduled)
+		return 0;
+	return runqueue_ns / nr_scheduled;
+}
+
+unsigned long get_sys_tid(void)
+{
+	return syscall(SYS_gettid);
+}
+
+/*
+ * once the message thread starts all his children, this is where he
+ * loops until our runtime is up.  Basically this sits around waiting
+ * for posting by the worker threads, and replying to their messages.
+ */
+static void run_msg_thread(struct thread_data *td)
+{
+	while (1) {
+		td->futex = FUTEX_BLOCKED;
+		xlist_wake_all(td);
+
+		if (stopping) {
+			xlist_wake_all(td);
+			break;
+		}
+		fwait_spin(&td->futex, NULL, 0, &msg_spin, &td->spin);
+	}
+}
+
+/*
+ * --wake-mode helper, one of these runs for each LLC and does the
+ * FUTEX_WAKEs for workers that went to sleep there.
+ */
+static void *wake_helper_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	int ret;
+
+	ret = pthread_setname_np(pthread_self(), "schbench-wake");
+	if (ret) {
+		perror("failed to set wake helper thread name");
+		exit(1);
+	}
+	td->sys_tid = get_sys_tid();
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				     llc_cpus + td->index);
+	if (ret)
+		fprintf(stderr, "unable to pin wake helper %lu\n", td->index);
+
+	while (1) {
+		td->futex = FUTEX_BLOCKED;
+		helper_wake_all(td);
+
+		if (stopping) {
+			helper_wake_all(td);
+			break;
+		}
+		fwait(&td->futex, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * one step of the -A controller.  This is a velocity form PI controller
+ * working on the normalized error (target - busy) / target.  Busy is
+ * roughly proportional to RPS, so we scale RPS by the controller output
+ * instead of adding to it.
+ *
+ * When we're far under the target we jump straight to the RPS the
+ * proportionality predicts, and then hold still for one busy window
+ * so we don't jump again off measurements from before the first jump.
+ */
+static void auto_scale_rps(struct rps_controller *ctl, float busy, double dt)
+{
+	double err = ((double)auto_rps - busy) / auto_rps;
+	double ki_dt = AUTO_RPS_KI * dt;
+	double factor;
+
+	ctl->samples++;
+	if (ctl->hold) {
+		ctl->hold--;
+		ctl->last_err = err;
+		return;
+	}
+
+	if (err > AUTO_RPS_JUMP_ERR && !ctl->converged_ns) {
+		factor = busy > 0 ? auto_rps / busy : AUTO_RPS_MAX_JUMP;
+		if (factor > AUTO_RPS_MAX_JUMP)
+			factor = AUTO_RPS_MAX_JUMP;
+		ctl->hold = ctl->window;
+	} else {
+		if (ki_dt > AUTO_RPS_KI_DT_MAX)
+			ki_dt = AUTO_RPS_KI_DT_MAX;
+		factor = 1 + AUTO_RPS_KP * (err - ctl->last_err) + ki_dt * err;
+		if (factor > AUTO_RPS_MAX_STEP)
+			factor = AUTO_RPS_MAX_STEP;
+		else if (factor < 1 / AUTO_RPS_MAX_STEP)
+			factor = 1 / AUTO_RPS_MAX_STEP;
+	}
+	ctl->last_err = err;
+
+	/*
+	 * we keep the fractional RPS around so small corrections add up
+	 * even when requests_per_sec is small.  Sometimes we don't have
+	 * enough threads to hit the target load, don't grow forever
+	 */
+	if (ctl->rps * factor < (1ULL << 31))
+		ctl->rps *= factor;
+	if (ctl->rps < 1)
+		ctl->rps = 1;
+	requests_per_sec = lround(ctl->rps);
+
+	if (fabs(err) > AUTO_RPS_BAND) {
+		ctl->in_band = 0;
+	} else if (!ctl->converged_ns && ++ctl->in_band >= AUTO_RPS_SETTLE) {
+		ctl->converged_ns = nsec_now() - ctl->start_ns;
+		auto_rps_target_hit = 1;
+		fprintf(stderr, "auto rps converged after %.2fs at %d rps\n",
+			(double)ctl->converged_ns / NSEC_PER_SEC,
+			requests_per_sec * message_threads);
+	}
+	if (ctl->converged_ns) {
+		ctl->steady_samples++;
+		ctl->steady_abs_err += fabs(auto_rps - busy);
+		ctl->steady_err += busy - auto_rps;
+	}
+}
+
+/*
+ * -A runs this in its own thread so it can sample faster than the once
+ * a second loop in sleep_for_runtime().  The RPS dispatcher works in one
+ * second batches, so each sample measures busy over the trailing second
+ * to keep the batches from looking like load swings
+ */
+static void *auto_rps_thread(void *arg)
+{
+	struct rps_controller *ctl = arg;
+	unsigned long long total_time = 0;
+	unsigned long long total_idle = 0;
+	unsigned long long hist_time[AUTO_RPS_WINDOW_MAX];
+	unsigned long long hist_idle[AUTO_RPS_WINDOW_MAX];
+	unsigned long long last;
+	unsigned long long now;
+	cpu_set_t *cpus = NULL;
+	int window = 1000 / auto_rps_period_ms;
+	int nr_hist = 0;
+	int oldest;
+	char *buf;
+	float busy;
+	int fd;
+
+	if (window < 1)
+		window = 1;
+	if (window > AUTO_RPS_WINDOW_MAX)
+		window = AUTO_RPS_WINDOW_MAX;
+	ctl->window = window;
+	ctl->rps = requests_per_sec;
+
+	pthread_setname_np(pthread_self(), "schbench-auto");
+	if (auto_rps_cpus && worker_cpus)
+		cpus = worker_cpus;
+
+	buf = malloc(PROC_STAT_BUF);
+	if (!buf) {
+		perror("unable to allocate /proc/stat buffer");
+		exit(1);
+	}
+	fd = open("/proc/stat", O_RDONLY);
+	if (fd < 0) {
+		perror("unable to open /proc/stat");
+		exit(1);
+	}
+
+	ctl->start_ns = nsec_now();
+	read_busy(fd, buf, PROC_STAT_BUF, cpus, &total_time, &total_idle);
+	hist_time[0] = total_time;
+	hist_idle[0] = total_idle;
+	nr_hist = 1;
+	last = ctl->start_ns;
+	while (!stopping) {
+		usleep(auto_rps_period_ms * 1000);
+		busy = read_busy(fd, buf, PROC_STAT_BUF, cpus, &total_time,
+				 &total_idle);
+		if (busy < 0)
+			continue;
+
+		/* hist[nr_hist % window] is the sample from one window ago */
+		oldest = nr_hist < window ? 0 : nr_hist % window;
+		busy = 100.00 - (float)(total_idle - hist_idle[oldest]) * 100.00 /
+			(float)(total_time - hist_time[oldest]);
+		hist_time[nr_hist % window] = total_time;
+		hist_idle[nr_hist % window] = total_idle;
+		nr_hist++;
+
+		now = nsec_now();
+		auto_scale_rps(ctl, busy, (double)(now - last) / NSEC_PER_SEC);
+		last = now;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+/* the most requests we'll let pile up on one worker */
+#define RPS_MAX_PENDING 128
+
+/* how many workers in this dispatcher's shard --phases has active */
+static int dispatcher_active(struct dispatcher *d)
+{
+	int active = active_workers - d->first;
+
+	if (active < 0)
+		return 0;
+	return active < d->nr_workers ? active : d->nr_workers;
+}
+
+/*
+ * hand one request to worker and wake it up.  --burst queues from its
+ * own thread on top of the dispatcher, so pending and peak_pending are
+ * updated atomically.  wake_time is last writer wins, same as when the
+ * worker stamps it on the way to sleep
+ */
+static void queue_request(struct thread_data *worker, struct timeval *now)
+{
+	struct request *request;
+	unsigned int pending;
+	unsigned int peak;
+
+	pending = __sync_add_and_fetch(&worker->pending, 1);
+	peak = worker->peak_pending;
+	while (pending > peak) {
+		if (__sync_bool_compare_and_swap(&worker->peak_pending, peak,
+						 pending))
+			break;
+		peak = worker->peak_pending;
+	}
+	request = allocate_request();
+	request_add(worker, request);
+	memcpy(&worker->wake_time, now, sizeof(*now));
+	if (wakeup_topology)
+		worker->wake_cpu = sched_getcpu();
+	flight_record(worker, FL_QUEUED, pending);
+	fpost(&worker->futex);
+}
+
+/*
+ * queue one request on the next worker in this dispatcher's shard and
+ * wake it.  Returns 0 without queueing anything if that worker already
+ * has too much
+ */
+static int rps_dispatch(struct dispatcher *d)
+{
+	struct thread_data *worker;
+	struct timeval now;
+	int nr_active;
+
+	gettimeofday(&now, NULL);
+
+	nr_active = dispatcher_active(d);
+	if (!nr_active)
+		return 0;
+	worker = d->workers + d->cur_tid % nr_active;
+	d->cur_tid++;
+
+	/* at some point, there's just too much, don't queue more */
+	if (worker->pending > RPS_MAX_PENDING) {
+		__sync_synchronize();
+		if (worker->pending > RPS_MAX_PENDING) {
+			d->dropped++;
+			return 0;
+		}
+	}
+	queue_request(worker, &now);
+	d->sent++;
+	return 1;
+}
+
+/*
+ * this dispatcher's share of requests_per_sec.  The shares add up to
+ * exactly requests_per_sec across the group's active workers
+ */
+static int dispatcher_rps(struct dispatcher *d)
+{
+	unsigned long long rps = requests_per_sec;
+	int active = active_workers;
+	int first = d->first < active ? d->first : active;
+
+	return rps * (first + dispatcher_active(d)) / active -
+		rps * first / active;
+}
+
+/*
+ * --pacing uniform and poisson.  Each request gets an absolute deadline
+ * and we clock_nanosleep until it comes up, unless it's too close to be
+ * worth sleeping for.  How late we were for each one goes into
+ * d->lateness
+ */
+static void run_paced_rps_thread(struct dispatcher *d)
+{
+	unsigned long long deadline = nsec_now();
+	unsigned long long interval;
+	unsigned long long now;
+	unsigned short rand_state[3];
+	struct timespec ts;
+	int rps;
+
+	rand_state[0] = d->index;
+	rand_state[1] = deadline;
+	rand_state[2] = deadline >> 16;
+
+	while (!stopping) {
+		/* -A and --slo change this as we go */
+		rps = dispatcher_rps(d);
+		if (rps < 1)
+			rps = 1;
+		interval = NSEC_PER_SEC / rps;
+		if (pacing == PACE_POISSON)
+			interval = -log(1.0 - erand48(rand_state)) * interval;
+		deadline += interval;
+
+		now = nsec_now();
+		if (deadline > now + PACE_MIN_SLEEP_NS) {
+			ts = ns_to_timespec(deadline);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			now = nsec_now();
+		}
+		add_lat(&d->lateness,
+			now > deadline ? (now - deadline) / 1000 : 0);
+
+		/* if we fell a whole second behind, don't make it up in one burst */
+		if (now > deadline + NSEC_PER_SEC) {
+			d->overruns++;
+			deadline = now;
+		}
+
+		rps_dispatch(d);
+	}
+}
+
+/*
+ * once the message thread starts all his children, this is where he
+ * loops until our runtime is up.  Basically this sits around waiting
+ * for posting by the worker threads, replying to their messages.
+ */
+static void run_rps_thread(struct dispatcher *d)
+{
+	/* start and end of the thread run */
+	struct timeval start;
+	struct timeval now;
+	unsigned long long delta;
+	int rps;
+	int i;
+
+	while (1) {
+		gettimeofday(&start, NULL);
+		rps = dispatcher_rps(d);
+		for (i = 1; i < rps + 1; i++) {
+			if (stopping)
+				break;
+			if (!rps_dispatch(d))
+				usleep(100);
+		}
+		gettimeofday(&now, NULL);
+
+		delta = tvdelta(&start, &now);
+		/* we couldn't get a second's worth out in a second */
+		if (!stopping && delta > USEC_PER_SEC)
+			d->overruns++;
+		while (!stopping && delta < USEC_PER_SEC) {
+			delta = USEC_PER_SEC - delta;
+			usleep(delta);
+
+			gettimeofday(&now, NULL);
+			delta = tvdelta(&start, &now);
+		}
+
+		if (stopping)
+			break;
+	}
+}
+
+/*
+ * run one RPS dispatcher until we're stopping, then wake its workers so
+ * they notice.  It records its own cpu time since the reporter can't
+ * read it after the thread exits
+ */
+static void run_dispatcher(struct dispatcher *d)
+{
+	struct timespec ts;
+	int i;
+
+	pthread_getcpuclockid(pthread_self(), &d->cpu_clock);
+	__sync_synchronize();
+	d->start_ns = nsec_now();
+	if (pacing != PACE_BURST)
+		run_paced_rps_thread(d);
+	else
+		run_rps_thread(d);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	d->cpu_ns = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	d->wall_ns = nsec_now() - d->start_ns;
+	for (i = 0; i < d->nr_workers; i++)
+		fpost(&d->workers[i].futex);
+}
+
+/* the extra --dispatchers threads, the message thread is dispatcher 0 */
+static void *dispatcher_thread(void *arg)
+{
+	pthread_setname_np(pthread_self(), "schbench-disp");
+	pthread_barrier_wait(&start_barrier);
+	run_dispatcher(arg);
+	return NULL;
+}
+
+/*
+ * multiply two matrices in a naive way to emulate some cache footprint
+ */
+static void do_some_math(unsigned long *data, unsigned long msize)
+{
+	unsigned long i, j, k;
+	unsigned long *m1, *m2, *m3;
+
+	m1 = &data[0];
+	m2 = &data[msize * msize];
+	m3 = &data[2 * msize * msize];
+
+	for (i = 0; i < msize; i++) {
+		for (j = 0; j < msize; j++) {
+			m3[i * msize + j] = 0;
+
+			for (k = 0; k < msize; k++)
+				m3[i * msize + j] +=
+					m1[i * msize + k] *
+					m2[k * msize + j];
+		}
+	}
+}
+
+/*
+ * STREAM style kernels over the same three arrays the matrix math uses,
+ * for when we want to be memory bandwidth bound instead.  Returns the
+ * number of bytes moved, counted the same way STREAM does.
+ */
+static unsigned long long do_some_streaming(unsigned long *data,
+					    unsigned long msize)
+{
+	unsigned long n = msize * msize;
+	unsigned long *a, *b, *c;
+	unsigned long i;
+
+	a = &data[0];
+	b = &data[n];
+	c = &data[2 * n];
+
+	switch (work_kernel) {
+	case KERNEL_COPY:
+		for (i = 0; i < n; i++)
+			c[i] = a[i];
+		return 2 * n * sizeof(unsigned long);
+	case KERNEL_SCALE:
+		for (i = 0; i < n; i++)
+			b[i] = 3 * c[i];
+		return 2 * n * sizeof(unsigned long);
+	case KERNEL_TRIAD:
+		for (i = 0; i < n; i++)
+			a[i] = b[i] + 3 * c[i];
+		return 3 * n * sizeof(unsigned long);
+	}
+	return 0;
+}
+
+/* run one operation of whichever --kernel we're using */
+static unsigned long long do_one_op(unsigned long *data, unsigned long msize)
+{
+	if (work_kernel == KERNEL_MATRIX) {
+		do_some_math(data, msize);
+		return 0;
+	}
+	return do_some_streaming(data, msize);
+}
+
+static pthread_mutex_t *lock_this_cpu(void)
+{
+	int cpu;
+	int cur_cpu;
+	pthread_mutex_t *lock;
+
+again:
+	cpu = sched_getcpu();
+	if (cpu < 0) {
+		perror("sched_getcpu failed\n");
+		exit(1);
+	}
+	lock = &per_cpu_locks[cpu].lock;
+	while (pthread_mutex_trylock(lock) != 0)
+		nop;
+
+	cur_cpu = sched_getcpu();
+	if (cur_cpu < 0) {
+		perror("sched_getcpu failed\n");
+		exit(1);
+	}
+
+	if (cur_cpu != cpu) {
+		/* we got the lock but we migrated */
+		pthread_mutex_unlock(lock);
+		goto again;
+	}
+	return lock;
+
+}
+
+/*
+ * spin or do some matrix arithmetic
+ */
+static void do_work(struct thread_data *td)
+{
+	pthread_mutex_t *lock = NULL;
+	unsigned long i;
+	unsigned long ops_shared, ops_private;
+	unsigned long long bytes = 0;
+	unsigned long long lock_start = 0;
+	unsigned long long start = 0;
+	unsigned long long ns;
+
+	if (td->breakdown_stats || td->flight)
+		lock_start = nsec_now();
+
+	/* using --calibrate or --no-locking skips the locks */
+	if (!skip_locking)
+		lock = lock_this_cpu();
+
+	if (td->bw_stats || td->breakdown_stats || td->flight)
+		start = nsec_now();
+	if (!skip_locking)
+		flight_record(td, FL_LOCK, (start - lock_start) / 1000);
+
+	/* Calculate operations split between shared and private data */
+	if (split_specified) {
+		ops_private = (operations * split_percent) / 100;
+		ops_shared = operations - ops_private;
+
+		/* Do operations on shared data */
+		if (shared_matrix_size > 0 && ops_shared > 0) {
+			for (i = 0; i < ops_shared; i++)
+				bytes += do_one_op(shared_data, shared_matrix_size);
+		}
+
+		/* Do operations on private data */
+		if (private_matrix_size > 0 && ops_private > 0) {
+			for (i = 0; i < ops_private; i++)
+				bytes += do_one_op(td->data, private_matrix_size);
+		}
+	} else {
+		/* Legacy behavior: if no split specified, use old matrix_size */
+		for (i = 0; i < operations; i++)
+			bytes += do_one_op(td->data, matrix_size);
+	}
+
+	if (td->bw_stats || td->breakdown_stats) {
+		ns = nsec_now() - start;
+
+		/* bytes per nanosecond is GB/s, we record MB/s */
+		if (td->bw_stats && ns)
+			add_lat(td->bw_stats, bytes * 1000 / ns);
+		if (td->breakdown_stats) {
+			if (!skip_locking)
+				add_lat(td->breakdown_stats + BD_LOCK,
+					(start - lock_start) / 1000);
+			add_lat(td->breakdown_stats + BD_COMPUTE, ns / 1000);
+		}
+	}
+
+	if (!skip_locking)
+		pthread_mutex_unlock(lock);
+}
+
+#ifndef __NR_epoll_pwait2
+#define __NR_epoll_pwait2 441
+#endif
+
+/* set up whatever the worker needs for --sleep-mode and --timerslack */
+static void sleep_setup(struct thread_data *td)
+{
+	td->sleep_fd = -1;
+	if (timerslack_ns >= 0 &&
+	    prctl(PR_SET_TIMERSLACK, timerslack_ns, 0, 0, 0)) {
+		perror("PR_SET_TIMERSLACK");
+		exit(1);
+	}
+	if (sleep_mode == SLEEP_TIMERFD) {
+		td->sleep_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (td->sleep_fd < 0) {
+			perror("timerfd_create");
+			exit(1);
+		}
+	} else if (sleep_mode == SLEEP_EPOLL) {
+		td->sleep_fd = epoll_create1(0);
+		if (td->sleep_fd < 0) {
+			perror("epoll_create1");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * the simulated networking part of each request, done with whichever
+ * --sleep-mode we were given.  How far past the requested time we
+ * woke up goes into the oversleep histogram, when we're keeping one
+ */
+static void do_sleep(struct thread_data *td, unsigned long usec)
+{
+	unsigned long long ns = usec * 1000ULL;
+	unsigned long long start = 0;
+	unsigned long long actual;
+	struct itimerspec its;
+	struct epoll_event ev;
+	struct timespec ts;
+	unsigned long long expirations;
+	int ret = 0;
+
+	if (sleep_mode == SLEEP_ABS || td->sleep_stats || td->breakdown_stats)
+		start = nsec_now();
+
+	switch (sleep_mode) {
+	case SLEEP_USLEEP:
+		usleep(usec);
+		break;
+	case SLEEP_NANOSLEEP:
+		ts = ns_to_timespec(ns);
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		break;
+	case SLEEP_ABS:
+		ts = ns_to_timespec(start + ns);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		break;
+	case SLEEP_TIMERFD:
+		memset(&its, 0, sizeof(its));
+		its.it_value = ns_to_timespec(ns);
+		if (timerfd_settime(td->sleep_fd, 0, &its, NULL) ||
+		    read(td->sleep_fd, &expirations, sizeof(expirations)) < 0) {
+			perror("timerfd");
+			exit(1);
+		}
+		break;
+	case SLEEP_EPOLL:
+		ts = ns_to_timespec(ns);
+		ret = syscall(__NR_epoll_pwait2, td->sleep_fd, &ev, 1, &ts,
+			      NULL, 0);
+		if (ret < 0 && errno != EINTR) {
+			perror("epoll_pwait2");
+			exit(1);
+		}
+		break;
+	case SLEEP_FUTEX:
+		ts = ns_to_timespec(ns);
+		td->sleep_futex = 0;
+		ret = futex(&td->sleep_futex, FUTEX_WAIT_PRIVATE, 0, &ts,
+			    NULL, 0);
+		if (ret < 0 && errno != ETIMEDOUT && errno != EINTR) {
+			perror("futex sleep");
+			exit(1);
+		}
+		break;
+	}
+
+	if (!td->sleep_stats && !td->breakdown_stats)
+		return;
+	actual = nsec_now() - start;
+	if (td->sleep_stats)
+		add_lat(td->sleep_stats, actual > ns ? (actual - ns) / 1000 : 0);
+	if (td->breakdown_stats)
+		add_lat(td->breakdown_stats + BD_SLEEP, actual / 1000);
+}
+
+/* the workers allocate their own footprint, these live with the --hugepages code */
+static void *alloc_footprint(size_t bytes);
+static void describe_backing(void *addr, char *buf, int len);
+
+static void pin_worker_cpus(cpu_set_t *worker_cpus)
+{
+	int ret;
+	pthread_t thread = pthread_self();
+	ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), worker_cpus);
+	if (ret) {
+		fprintf(stderr, "unable to set CPU affinity\n");
+	}
+}
+
+/* how often the --phases thread moves the knobs, in ms */
+#define PHASE_TICK_MS 100
+
+/*
+ * --phases.  Workers past active_workers sleep on phase_gen, which gets
+ * bumped every time active_workers changes and when we're stopping.
+ * A dispatcher can still hand us a request it picked before
+ * active_workers dropped, so we also wait on our own futex for the
+ * fpost from queue_request.  Kernels without futex_waitv just poll
+ * every PHASE_TICK_MS instead
+ */
+static int phase_gen = 0;
+
+static void park_worker(struct thread_data *td)
+{
+	struct timespec timeout = {
+		.tv_sec = 0,
+		.tv_nsec = PHASE_TICK_MS * 1000000,
+	};
+	int gen = *(volatile int *)&phase_gen;
+	int s;
+
+	td->futex = FUTEX_BLOCKED;
+	__sync_synchronize();
+	if ((int)td->index < active_workers || td->request || stopping)
+		return;
+	s = futex_waitv2(&td->futex, FUTEX_BLOCKED, &phase_gen, gen);
+	if (s == -1 && errno == ENOSYS)
+		s = futex(&phase_gen, FUTEX_WAIT_PRIVATE, gen, &timeout,
+			  NULL, 0);
+	if (s == -1 && errno != EAGAIN && errno != EINTR &&
+	    errno != ETIMEDOUT) {
+		perror("futex_waitv");
+		exit(1);
+	}
+}
+
+/*
+ * the worker thread is pretty simple, it just does a single spin and
+ * then waits on a message from the message thread
+ */
+void *worker_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct timeval now;
+	struct timeval work_start;
+	struct timeval start;
+	unsigned long long delta;
+	struct request *req = NULL;
+	unsigned long alloc_size;
+	int ret;
+
+	td->sys_tid = get_sys_tid();
+
+	ret = pthread_setname_np(pthread_self(), "schbench-worker");
+	if (ret) {
+		perror("failed to set worker thread name");
+		exit(1);
+	}
+	if (td->pin_cpus)
+		pin_worker_cpus(td->pin_cpus);
+
+	/*
+	 * Allocate based on private_matrix_size if using split, else use
+	 * matrix_size.  We do this after pinning so the pages come from
+	 * wherever we're going to run.  --respawn hands us the last
+	 * iteration's footprint, which we keep.
+	 */
+	if (private_matrix_size > 0)
+		alloc_size = private_matrix_size;
+	else
+		alloc_size = matrix_size;
+
+	if (!td->data) {
+		td->data = alloc_footprint(3 * sizeof(unsigned long) * alloc_size * alloc_size);
+		if (!td->data) {
+			perror("unable to allocate ram");
+			exit(1);
+		}
+		if (td->msg_thread->index == 0 && td->index == 0 &&
+		    page_backing != PAGES_DEFAULT) {
+			describe_backing(td->data, worker_backing,
+					 sizeof(worker_backing));
+			fprintf(stderr, "worker data backing: %s\n", worker_backing);
+		}
+	}
+	sleep_setup(td);
+
+	/* everyone starts generating load at the same time */
+	pthread_barrier_wait(&start_barrier);
+	gettimeofday(&start, NULL);
+	while(1) {
+		if (stopping)
+			break;
+
+		/* --phases turned us off, finish what we have and sleep */
+		if ((int)td->index >= active_workers && !td->request) {
+			park_worker(td);
+			continue;
+		}
+
+		req = msg_and_wait(td);
+		if (requests_per_sec && !req)
+			continue;
+
+		do {
+			struct request *tmp;
+
+			if (pipe_test) {
+				gettimeofday(&work_start, NULL);
+			} else {
+				if (calibrate_only) {
+					/*
+					 * in calibration mode, don't include the
+					 * usleep in the timing
+					 */
+					if (sleep_usec > 0)
+						do_sleep(td, sleep_usec);
+					gettimeofday(&work_start, NULL);
+				} else {
+					/*
+					 * lets start off with some simulated networking,
+					 * and also make sure we get a fresh clean timeslice
+					 */
+					gettimeofday(&work_start, NULL);
+					if (sleep_usec > 0)
+						do_sleep(td, sleep_usec);
+				}
+				do_work(td);
+			}
+
+			gettimeofday(&now, NULL);
+
+			td->runtime = tvdelta(&start, &now);
+			/* only -R requests know when they were dispatched */
+			if (req && td->breakdown_stats) {
+				add_lat(td->breakdown_stats + BD_QUEUE,
+					tvdelta(&req->start_time, &work_start));
+				add_lat(td->breakdown_stats + BD_E2E,
+					tvdelta(&req->start_time, &now));
+			}
+			if (req) {
+				tmp = req->next;
+				free(req);
+				req = tmp;
+			}
+			td->loop_count++;
+
+			delta = tvdelta(&work_start, &now);
+			if (delta > 0)
+				add_lat(td->request_stats, delta);
+			if (td->flight) {
+				flight_record(td, FL_DONE, delta);
+				if (delta >= flight_usec)
+					flight_dump(td, FL_DONE, delta);
+			}
+		} while (req);
+	}
+	gettimeofday(&now, NULL);
+	td->runtime = tvdelta(&start, &now);
+	if (td->sleep_fd >= 0)
+		close(td->sleep_fd);
+
+	return NULL;
+}
+
+int find_nth_set_bit(const cpu_set_t *set, int n)
+{
+	int count = 0;
+	for (int i = 0; i < CPU_SETSIZE; ++i) {
+		if (CPU_ISSET(i, set)) {
+			if (count == n)
+				return i; // Return the CPU index of the n’th set bit
+			++count;
+		}
+	}
+	return -1; // Not found
+}
+
+static void pin_message_cpu(int index, cpu_set_t *possible_cpus)
+{
+	cpu_set_t cpuset;
+	int ret;
+	CPU_ZERO(&cpuset);
+	int num_possible = CPU_COUNT(possible_cpus);
+	int cpu_to_set = index % num_possible;
+
+	cpu_to_set = find_nth_set_bit(possible_cpus, cpu_to_set);
+	CPU_SET(cpu_to_set, &cpuset); // Pin to CPU 0
+
+	pthread_t thread = pthread_self();
+	ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
+	if (ret) {
+		fprintf(stderr, "unable to set CPU affinity to cpu %d\n", cpu_to_set);
+		exit(1);
+	}
+	fprintf(stderr, "Pinning to message thread index %d cpu %d\n", index, cpu_to_set);
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_2MB (2UL * 1024 * 1024)
+#define HUGE_1GB (1024UL * 1024 * 1024)
+
+/*
+ * allocate the memory for a worker's matrices or shared_data, backed
+ * however --hugepages asked for.  Explicit backings are touched before we
+ * return so the backing is decided here and not in the middle of a request
+ */
+static void *alloc_footprint(size_t bytes)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	size_t align = getpagesize();
+	size_t len;
+	int advice = MADV_HUGEPAGE;
+	char *p;
+
+	/* the default leaves first touch to the worker, like always */
+	if (page_backing == PAGES_DEFAULT)
+		return malloc(bytes);
+
+	if (page_backing == PAGES_2M || page_backing == PAGES_THP)
+		align = HUGE_2MB;
+	else if (page_backing == PAGES_1G)
+		align = HUGE_1GB;
+	len = (bytes + align - 1) & ~(align - 1);
+	if (!len)
+		len = align;
+
+	if (page_backing == PAGES_2M || page_backing == PAGES_1G) {
+		int shift = page_backing == PAGES_2M ? 21 : 30;
+
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 flags | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+		if (p != MAP_FAILED) {
+			memset(p, 0, len);
+			return p;
+		}
+		/* no hugetlb pages reserved, use whatever the system default is */
+		if (__sync_fetch_and_add(&hugetlb_fallbacks, 1) == 0)
+			fprintf(stderr, "MAP_HUGETLB failed, falling back to normal pages\n");
+		align = getpagesize();
+		advice = -1;
+	}
+	bytes = (bytes + align - 1) & ~(align - 1);
+	if (!bytes)
+		bytes = align;
+
+	/* over allocate so THP has an aligned region to work with */
+	p = mmap(NULL, bytes + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if ((unsigned long)p & (align - 1)) {
+		size_t head = align - ((unsigned long)p & (align - 1));
+
+		munmap(p, head);
+		p += head;
+		munmap(p + bytes, align - head);
+	} else {
+		munmap(p + bytes, align);
+	}
+
+	if (page_backing == PAGES_4K)
+		advice = MADV_NOHUGEPAGE;
+	if (advice >= 0)
+		madvise(p, bytes, advice);
+	memset(p, 0, bytes);
+	return p;
+}
+
+/*
+ * find the mapping holding addr in /proc/self/smaps and describe what
+ * kind of pages we actually got for it
+ */
+static void describe_backing(void *addr, char *buf, int len)
+{
+	unsigned long target = (unsigned long)addr;
+	unsigned long start, end;
+	unsigned long kb;
+	unsigned long size_kb = 0;
+	unsigned long page_kb = 0;
+	unsigned long thp_kb = 0;
+	unsigned long hugetlb_kb = 0;
+	int found = 0;
+	char line[512];
+	FILE *fp;
+
+	snprintf(buf, len, "unknown");
+	fp = fopen("/proc/self/smaps", "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2 &&
+		    strchr(line, '-') < strchr(line, ' ')) {
+			if (found)
+				break;
+			found = target >= start && target < end;
+			continue;
+		}
+		if (!found)
+			continue;
+		if (sscanf(line, "Size: %lu kB", &kb) == 1)
+			size_kb = kb;
+		else if (sscanf(line, "KernelPageSize: %lu kB", &kb) == 1)
+			page_kb = kb;
+		else if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			thp_kb = kb;
+		else if (sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1)
+			hugetlb_kb += kb;
+		else if (sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1)
+			hugetlb_kb += kb;
+	}
+	fclose(fp);
+	if (!found)
+		return;
+
+	if (hugetlb_kb || page_kb > 4)
+		snprintf(buf, len, "hugetlb %lukB pages", page_kb);
+	else if (thp_kb)
+		snprintf(buf, len, "thp %lu of %lu kB", thp_kb, size_kb);
+	else
+		snprintf(buf, len, "%lukB pages", page_kb);
+}
+
+/* read a cpu list like 0-3,8-11 out of sysfs, returns 1 on success */
+static int read_sysfs_cpuset(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	chomp(buf);
+	return parse_cpuset(buf, set);
+}
+
+/* read a single integer out of sysfs, returns def if we can't */
+static int read_sysfs_int(const char *path, int def)
+{
+	FILE *fp;
+	int val;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return def;
+	if (fscanf(fp, "%d", &val) != 1)
+		val = def;
+	fclose(fp);
+	return val;
+}
+
+/*
+ * find the highest level cache sysfs knows about for this CPU and fill
+ * in the set of CPUs sharing it.  CPUs without cache info end up in
+ * their own LLC
+ */
+static int find_llc_index(int cpu)
+{
+	char path[256];
+	int best_level = 0;
+	int best_index = -1;
+	int level;
+	int i;
+
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 cpu, i);
+		level = read_sysfs_int(path, -1);
+		if (level < 0)
+			break;
+		if (level > best_level) {
+			best_level = level;
+			best_index = i;
+		}
+	}
+	return best_index;
+}
+
+static void read_cpu_llc(int cpu, cpu_set_t *set)
+{
+	char path[256];
+	int best_index = find_llc_index(cpu);
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+		 cpu, best_index);
+	if (best_index < 0 || !read_sysfs_cpuset(path, set)) {
+		CPU_ZERO(set);
+		CPU_SET(cpu, set);
+	}
+}
+
+/* size of cpu 0's LLC in bytes, sysfs always reports it in K */
+static size_t read_llc_bytes(size_t def)
+{
+	char path[256];
+	int best_index = find_llc_index(0);
+	int kb;
+
+	if (best_index < 0)
+		return def;
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu0/cache/index%d/size", best_index);
+	kb = read_sysfs_int(path, -1);
+	if (kb <= 0)
+		return def;
+	return (size_t)kb * 1024;
+}
+
+/* sysfs puts a nodeN link in each CPU directory */
+static int read_cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir))) {
+		if (!strncmp(de->d_name, "node", 4) && isdigit(de->d_name[4])) {
+			node = atoi(de->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+/*
+ * walk /sys/devices/system/cpu and figure out the SMT siblings, LLC,
+ * package and NUMA node for each CPU.  Safe to call more than once
+ */
+static void read_cpu_topology(void)
+{
+	int nr_cpus = get_nprocs_conf();
+	char path[256];
+	cpu_set_t set;
+	int cpu;
+	int i;
+
+	if (cpu_topo)
+		return;
+	if (nr_cpus > CPU_SETSIZE)
+		nr_cpus = CPU_SETSIZE;
+	cpu_topo = calloc(CPU_SETSIZE, sizeof(*cpu_topo));
+	llc_cpus = calloc(nr_cpus, sizeof(*llc_cpus));
+	if (!cpu_topo || !llc_cpus) {
+		perror("unable to allocate cpu topology");
+		exit(1);
+	}
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		struct cpu_topo *t = cpu_topo + cpu;
+
+		/* SMT siblings share a core, name it after the first sibling */
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+			 cpu);
+		if (read_sysfs_cpuset(path, &set))
+			t->core = find_nth_set_bit(&set, 0);
+		else
+			t->core = cpu;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			 cpu);
+		t->package = read_sysfs_int(path, 0);
+		t->node = read_cpu_node(cpu);
+
+		read_cpu_llc(cpu, &set);
+		for (i = 0; i < nr_llc; i++) {
+			if (CPU_EQUAL(&set, llc_cpus + i))
+				break;
+		}
+		if (i == nr_llc)
+			llc_cpus[nr_llc++] = set;
+		t->llc = i;
+	}
+}
+
+/*
+ * the CPUs --pin gets to work with: -W if it was given, otherwise
+ * whatever we're allowed to run on.  --no-smt keeps only the first
+ * of those on each core
+ */
+static int pin_usable_cpus(int *cpus)
+{
+	cpu_set_t set;
+	cpu_set_t seen_cores;
+	int nr = 0;
+	int cpu;
+
+	if (worker_cpus)
+		set = *worker_cpus;
+	else if (sched_getaffinity(0, sizeof(set), &set)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+
+	CPU_ZERO(&seen_cores);
+	for (cpu = 0; cpu < get_nprocs_conf() && cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		if (pin_no_smt) {
+			if (CPU_ISSET(cpu_topo[cpu].core, &seen_cores))
+				continue;
+			CPU_SET(cpu_topo[cpu].core, &seen_cores);
+		}
+		cpus[nr++] = cpu;
+	}
+	if (!nr) {
+		fprintf(stderr, "no usable CPUs for --pin\n");
+		exit(1);
+	}
+	return nr;
+}
+
+/* node, package, LLC and then core order, so neighbors end up together */
+static int cmp_cpu_compact(const void *a, const void *b)
+{
+	struct cpu_topo *ta = cpu_topo + *(int *)a;
+	struct cpu_topo *tb = cpu_topo + *(int *)b;
+
+	if (ta->node != tb->node)
+		return ta->node - tb->node;
+	if (ta->package != tb->package)
+		return ta->package - tb->package;
+	if (ta->llc != tb->llc)
+		return ta->llc - tb->llc;
+	if (ta->core != tb->core)
+		return ta->core - tb->core;
+	return *(int *)a - *(int *)b;
+}
+
+/*
+ * reorder a compact list so each step moves to a different LLC, and
+ * ideally a different node.  Within each LLC we use one CPU from every
+ * core before coming back for the SMT siblings
+ */
+static void spread_cpus(int *cpus, int nr)
+{
+	int *sorted = malloc(nr * sizeof(int));
+	int *rank = calloc(nr, sizeof(int));
+	int *llcs = malloc(nr * sizeof(int));
+	int *llc_node_rank = calloc(nr, sizeof(int));
+	int nr_llcs = 0;
+	int out = 0;
+	int i, j, r, max_rank = 0;
+
+	if (!sorted || !rank || !llcs || !llc_node_rank) {
+		perror("unable to allocate pin ordering");
+		exit(1);
+	}
+
+	/* SMT rank: how many siblings from the same core came before us */
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < i; j++) {
+			if (cpu_topo[cpus[j]].core == cpu_topo[cpus[i]].core)
+				rank[i]++;
+		}
+		if (rank[i] > max_rank)
+			max_rank = rank[i];
+	}
+
+	/* the LLCs in the order they show up, and their index in the node */
+	for (i = 0; i < nr; i++) {
+		int llc = cpu_topo[cpus[i]].llc;
+
+		for (j = 0; j < nr_llcs; j++) {
+			if (llcs[j] == llc)
+				break;
+		}
+		if (j < nr_llcs)
+			continue;
+		llcs[nr_llcs++] = llc;
+	}
+	for (i = 0; i < nr_llcs; i++) {
+		for (j = 0; j < i; j++) {
+			int ci = find_nth_set_bit(llc_cpus + llcs[i], 0);
+			int cj = find_nth_set_bit(llc_cpus + llcs[j], 0);
+
+			if (cpu_topo[ci].node == cpu_topo[cj].node)
+				llc_node_rank[i]++;
+		}
+	}
+
+	/*
+	 * for each SMT rank, take the Nth CPU of every LLC, walking the LLCs
+	 * one node at a time
+	 */
+	for (r = 0; r <= max_rank; r++) {
+		int pass;
+
+		for (pass = 0; out < nr; pass++) {
+			int found = 0;
+			int node_rank;
+
+			for (node_rank = 0; node_rank < nr_llcs; node_rank++) {
+				for (j = 0; j < nr_llcs; j++) {
+					int seen = 0;
+
+					if (llc_node_rank[j] != node_rank)
+						continue;
+					for (i = 0; i < nr; i++) {
+						if (rank[i] != r ||
+						    cpu_topo[cpus[i]].llc != llcs[j])
+							continue;
+						if (seen++ == pass) {
+							sorted[out++] = cpus[i];
+							found = 1;
+							break;
+						}
+					}
+				}
+			}
+			if (!found)
+				break;
+		}
+	}
+	memcpy(cpus, sorted, nr * sizeof(int));
+	free(sorted);
+	free(rank);
+	free(llcs);
+	free(llc_node_rank);
+}
+
+/* how many distinct LLCs the --pin usable CPUs live in */
+static int pin_usable_llcs(int *cpus, int nr, int *llcs)
+{
+	int nr_llcs = 0;
+	int i, j;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < nr_llcs; j++) {
+			if (llcs[j] == cpu_topo[cpus[i]].llc)
+				break;
+		}
+		if (j == nr_llcs)
+			llcs[nr_llcs++] = cpu_topo[cpus[i]].llc;
+	}
+	return nr_llcs;
+}
+
+static void print_topology(void)
+{
+	cpu_set_t cores, packages, nodes;
+	int nr_cpus = 0;
+	int cpu;
+
+	CPU_ZERO(&cores);
+	CPU_ZERO(&packages);
+	CPU_ZERO(&nodes);
+	for (cpu = 0; cpu < get_nprocs_conf() && cpu < CPU_SETSIZE; cpu++) {
+		nr_cpus++;
+		CPU_SET(cpu_topo[cpu].core, &cores);
+		CPU_SET(cpu_topo[cpu].package, &packages);
+		CPU_SET(cpu_topo[cpu].node, &nodes);
+	}
+	fprintf(stderr, "topology: %d cpus %d cores %d llcs %d packages %d nodes\n",
+		nr_cpus, CPU_COUNT(&cores), nr_llc, CPU_COUNT(&packages),
+		CPU_COUNT(&nodes));
+}
+
+/*
+ * --pin llc with no -m gets one message thread for every LLC we're
+ * allowed to use
+ */
+static void pin_pick_message_threads(void)
+{
+	int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+	int *llcs = malloc(CPU_SETSIZE * sizeof(int));
+	int nr;
+
+	if (!cpus || !llcs) {
+		perror("unable to allocate pin cpus");
+		exit(1);
+	}
+	nr = pin_usable_cpus(cpus);
+	message_threads = pin_usable_llcs(cpus, nr, llcs);
+	fprintf(stderr, "pin llc: using %d message threads\n", message_threads);
+	free(cpus);
+	free(llcs);
+}
+
+/*
+ * fill in td->pin_cpus for every thread according to --pin.  Threads
+ * are handed CPUs in group order, each message thread and then its
+ * workers
+ */
+static void apply_pin_policy(struct thread_data *thread_data)
+{
+	int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+	int *llcs = malloc(CPU_SETSIZE * sizeof(int));
+	int nr_threads = message_threads * worker_threads + message_threads;
+	int nr, nr_llcs;
+	int i, j;
+
+	if (!cpus || !llcs) {
+		perror("unable to allocate pin cpus");
+		exit(1);
+	}
+	nr = pin_usable_cpus(cpus);
+	qsort(cpus, nr, sizeof(int), cmp_cpu_compact);
+	if (pin_policy == PIN_SPREAD)
+		spread_cpus(cpus, nr);
+	nr_llcs = pin_usable_llcs(cpus, nr, llcs);
+
+	for (i = 0; i < nr_threads; i++) {
+		thread_data[i].pin_cpus = calloc(1, sizeof(cpu_set_t));
+		if (!thread_data[i].pin_cpus) {
+			perror("unable to allocate pin cpus");
+			exit(1);
+		}
+	}
+
+	if (pin_policy != PIN_LLC) {
+		for (i = 0; i < nr_threads; i++)
+			CPU_SET(cpus[i % nr], thread_data[i].pin_cpus);
+		fprintf(stderr, "pin %s: %d threads on %d cpus\n",
+			pin_policy_names[pin_policy], nr_threads, nr);
+		goto out;
+	}
+
+	for (i = 0; i < message_threads; i++) {
+		struct thread_data *td = thread_data + i * worker_threads + i;
+		int llc = llcs[i % nr_llcs];
+		cpu_set_t llc_set;
+		int msg_cpu = -1;
+
+		CPU_ZERO(&llc_set);
+		for (j = 0; j < nr; j++) {
+			if (cpu_topo[cpus[j]].llc != llc)
+				continue;
+			if (msg_cpu < 0)
+				msg_cpu = cpus[j];
+			CPU_SET(cpus[j], &llc_set);
+		}
+		CPU_SET(msg_cpu, td->pin_cpus);
+		for (j = 1; j <= worker_threads; j++)
+			*td[j].pin_cpus = llc_set;
+		fprintf(stderr, "pin llc: message thread %d on cpu %d, workers on %d cpus in llc %d\n",
+			i, msg_cpu, CPU_COUNT(&llc_set), llc);
+	}
+out:
+	free(cpus);
+	free(llcs);
+}
+
+/*
+ * the message thread starts his own gaggle of workers and then sits around
+ * replying when they post him.  He collects latency stats as all the threads
+ * exit
+ */
+void *message_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct thread_data *worker_threads_mem = NULL;
+	int i;
+	int ret;
+
+	ret = pthread_setname_np(pthread_self(), "schbench-msg");
+	if (ret) {
+		perror("failed to set message thread name");
+		exit(1);
+	}
+	worker_threads_mem = td + 1;
+
+	td->sys_tid = get_sys_tid();
+
+	if (worker_cpus)
+		pin_worker_cpus(worker_cpus);
+
+	/*
+	 * the workers allocate their own memory, so all we do here is
+	 * pthread_create and the groups all spawn in parallel
+	 */
+	for (i = 0; i < worker_threads; i++) {
+		pthread_t tid;
+
+		worker_threads_mem[i].msg_thread = td;
+		worker_threads_mem[i].index = i;
+		ret = pthread_create(&tid, &thread_attr, worker_thread,
+				     worker_threads_mem + i);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+		worker_threads_mem[i].tid = tid;
+	}
+
+	if (td->pin_cpus)
+		pin_worker_cpus(td->pin_cpus);
+	else if (message_cpus)
+		pin_message_cpu(td->index, message_cpus);
+
+	if (requests_per_sec) {
+		struct dispatcher *d = dispatchers + td->index * nr_dispatchers;
+
+		/* the rest of the dispatchers inherit our cpu affinity */
+		for (i = 1; i < nr_dispatchers; i++) {
+			ret = pthread_create(&d[i].tid, &thread_attr,
+					     dispatcher_thread, d + i);
+			if (ret) {
+				fprintf(stderr, "error %d from pthread_create\n", ret);
+				exit(1);
+			}
+		}
+		d->tid = pthread_self();
+		pthread_barrier_wait(&start_barrier);
+		run_dispatcher(d);
+		for (i = 1; i < nr_dispatchers; i++)
+			pthread_join(d[i].tid, NULL);
+	} else {
+		pthread_barrier_wait(&start_barrier);
+		run_msg_thread(td);
+	}
+
+	for (i = 0; i < worker_threads; i++) {
+		fpost(&worker_threads_mem[i].futex);
+		if (wake_mode == WAKE_SHARED)
+			wake_gen_all(&td->wake_gen);
+		pthread_join(worker_threads_mem[i].tid, NULL);
+	}
+	return NULL;
+}
+
+static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
+
+static double pretty_size(double number, char **str)
+{
+	int divs = 0;
+
+	while(number >= 1024) {
+		if (units[divs + 1] == NULL)
+			break;
+		divs++;
+		number /= 1024;
+	}
+	*str = units[divs];
+	return number;
+}
+
+/*
+ * we want to calculate RPS more often than the full message stats,
+ * so this is a less expensive walk through all the message threads
+ * to pull that out
+ */
+static void combine_message_thread_rps(struct thread_data *thread_data,
+				       unsigned long long *loop_count)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*loop_count = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			*loop_count += worker->loop_count;
+		}
+	}
+}
+
+/*
+ * read /proc/pid/schedstat for each of our threads and average out the delay
+ * recorded on the kernel side for scheduling us.  This should be similar
+ * to the delays we record between wakeup and actually running, but differences
+ * can expose problems in different parts of the wakeup paths
+ */
+static void collect_sched_delay(struct thread_data *thread_data,
+				unsigned long long *message_thread_delay_ret,
+				unsigned long long *worker_thread_delay_ret)
+{
+	struct thread_data *worker;
+	unsigned long long message_thread_delay = 0;
+	unsigned long long worker_thread_delay = 0;
+	unsigned long long delay;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		delay = read_sched_delay(thread_data + index);
+		message_thread_delay += delay;
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			delay = read_sched_delay(worker);
+			worker_thread_delay += delay;
+		}
+	}
+	*message_thread_delay_ret = message_thread_delay / message_threads;
+	*worker_thread_delay_ret = worker_thread_delay / (message_threads * worker_threads);
+}
+
+static void combine_message_thread_stats(struct stats *wakeup_stats,
+					 struct stats *request_stats,
+					struct thread_data *thread_data,
+					unsigned long long *loop_count,
+					unsigned long long *loop_runtime)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	*loop_count = 0;
+	*loop_runtime = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(wakeup_stats, worker->wakeup_stats);
+			combine_stats(request_stats, worker->request_stats);
+			*loop_count += worker->loop_count;
+			*loop_runtime += worker->runtime;
+		}
+	}
+}
+
+/* the optional per-worker histogram arrays */
+enum {
+	WORKER_WAKE_POS = 0,
+	WORKER_BW,
+	WORKER_DIST,
+	WORKER_SLEEP,
+	WORKER_BREAKDOWN,
+};
+
+/* one of the optional histogram arrays, and how many histograms it has */
+static struct stats *worker_stats(struct thread_data *worker, int which,
+				  int *nr)
+{
+	switch (which) {
+	case WORKER_WAKE_POS:
+		*nr = WAKE_POS_BUCKETS;
+		return worker->wake_pos_stats;
+	case WORKER_BW:
+		*nr = 1;
+		return worker->bw_stats;
+	case WORKER_DIST:
+		*nr = NR_DIST;
+		return worker->dist_stats;
+	case WORKER_SLEEP:
+		*nr = 1;
+		return worker->sleep_stats;
+	case WORKER_BREAKDOWN:
+		*nr = NR_BREAKDOWN;
+		return worker->breakdown_stats;
+	}
+	*nr = 0;
+	return NULL;
+}
+
+/* sum up one of the optional per-worker histogram arrays into d */
+static void combine_worker_stats(struct stats *d, int which,
+				 struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	struct stats *s;
+	int i, j;
+	int msg_i;
+	int nr;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			s = worker_stats(worker, which, &nr);
+			if (!s)
+				continue;
+			for (j = 0; j < nr; j++)
+				combine_stats(d + j, s + j);
+		}
+	}
+}
+
+/* sum up dispatcher lateness and counters across every group */
+static void combine_dispatcher_stats(struct stats *lateness,
+				     unsigned long long *dropped,
+				     unsigned long long *overruns)
+{
+	int i;
+
+	*dropped = 0;
+	*overruns = 0;
+	for (i = 0; i < message_threads * nr_dispatchers; i++) {
+		combine_stats(lateness, &dispatchers[i].lateness);
+		*dropped += dispatchers[i].dropped;
+		*overruns += dispatchers[i].overruns;
+	}
+}
+
+/*
+ * cpu use of the busiest dispatcher since the last time we asked, in
+ * percent.  Only valid while the dispatchers are running
+ */
+static double busiest_dispatcher(void)
+{
+	struct dispatcher *d;
+	struct timespec ts;
+	unsigned long long cpu_ns;
+	unsigned long long now;
+	double pct;
+	double max = 0;
+	int i;
+
+	for (i = 0; i < message_threads * nr_dispatchers; i++) {
+		d = dispatchers + i;
+		if (!d->start_ns)
+			continue;
+		__sync_synchronize();
+		if (clock_gettime(d->cpu_clock, &ts))
+			continue;
+		cpu_ns = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+		now = nsec_now();
+		if (!d->last_ns)
+			d->last_ns = d->start_ns;
+		pct = (double)(cpu_ns - d->last_cpu_ns) * 100 / (now - d->last_ns);
+		d->last_cpu_ns = cpu_ns;
+		d->last_ns = now;
+		if (pct > max)
+			max = pct;
+	}
+	return max;
+}
+
+/*
+ * print the dispatchers that look like they were the bottleneck, and
+ * a summary line for all of them
+ */
+static void show_dispatchers(void)
+{
+	struct dispatcher *d;
+	unsigned long long sent = 0;
+	unsigned long long dropped = 0;
+	unsigned long long overruns = 0;
+	double pct;
+	double max = 0;
+	int i;
+
+	for (i = 0; i < message_threads * nr_dispatchers; i++) {
+		d = dispatchers + i;
+		pct = d->wall_ns ? (double)d->cpu_ns * 100 / d->wall_ns : 0;
+		if (pct > max)
+			max = pct;
+		sent += d->sent;
+		dropped += d->dropped;
+		overruns += d->overruns;
+		if (pct < DISPATCH_SATURATED_PCT && !d->dropped && !d->overruns)
+			continue;
+		fprintf(stderr, "dispatcher %d.%d (%d workers): sent %llu dropped %llu overruns %llu lateness p99 %u usec cpu %.1f%%\n",
+			i / nr_dispatchers, i % nr_dispatchers, d->nr_workers,
+			d->sent, d->dropped, d->overruns,
+			stats_percentile(&d->lateness, 99.0), pct);
+	}
+	fprintf(stderr, "dispatchers: %d sent %llu dropped %llu overruns %llu busiest %.1f%% cpu%s\n",
+		message_threads * nr_dispatchers, sent, dropped, overruns, max,
+		max >= DISPATCH_SATURATED_PCT || overruns ? " (saturated)" : "");
+}
+
+/*
+ * cpu use of the busiest dispatcher over the whole run, in percent.
+ * Unlike busiest_dispatcher() this only reads the totals, so it's safe
+ * once the dispatchers have exited
+ */
+static double busiest_dispatcher_total(void)
+{
+	struct dispatcher *d;
+	double pct;
+	double max = 0;
+	int i;
+
+	for (i = 0; i < message_threads * nr_dispatchers; i++) {
+		d = dispatchers + i;
+		pct = d->wall_ns ? (double)d->cpu_ns * 100 / d->wall_ns : 0;
+		if (pct > max)
+			max = pct;
+	}
+	return max;
+}
+
+/* more than one dispatcher, or one that couldn't keep up */
+static int dispatch_worth_reporting(unsigned long long dropped,
+				    unsigned long long overruns,
+				    double busiest)
+{
+	return nr_dispatchers > 1 || dropped || overruns ||
+		busiest >= DISPATCH_SATURATED_PCT;
+}
+
+/*
+ * fold each worker's histograms from this iteration into fair_workers,
+ * and each group's into fair_groups.  Like the totals, loops only get
+ * added once the counters are final
+ */
+static void record_fairness(struct thread_data *thread_data, int add_loops)
+{
+	struct thread_data *worker;
+	struct fair_stats *group;
+	struct fair_stats *fs;
+	int msg_i;
+	int i;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		worker = thread_data + msg_i * (worker_threads + 1) + 1;
+		group = fair_groups + msg_i;
+		for (i = 0; i < worker_threads; i++) {
+			fs = fair_workers + msg_i * worker_threads + i;
+			combine_stats(&fs->wakeup, worker[i].wakeup_stats);
+			combine_stats(&fs->request, worker[i].request_stats);
+			combine_stats(&group->wakeup, worker[i].wakeup_stats);
+			combine_stats(&group->request, worker[i].request_stats);
+			if (add_loops) {
+				fs->loops += worker[i].loop_count;
+				group->loops += worker[i].loop_count;
+			}
+		}
+	}
+}
+
+static struct stats *alloc_worker_stats(int nr)
+{
+	struct stats *s = calloc(nr, sizeof(*s));
+
+	if (!s) {
+		perror("unable to allocate stats");
+		exit(1);
+	}
+	return s;
+}
+
+static void add_spin_stats(struct spin_stats *d, struct spin_stats *s)
+{
+	d->nr_waits += s->nr_waits;
+	d->nr_spin_hits += s->nr_spin_hits;
+	d->spin_ns += s->spin_ns;
+}
+
+/* sum up the --worker-spin and --msg-spin accounting */
+static void combine_spin_stats(struct thread_data *thread_data,
+			       struct spin_stats *worker_ss,
+			       struct spin_stats *msg_ss)
+{
+	int i;
+	int msg_i;
+	int index = 0;
+
+	memset(worker_ss, 0, sizeof(*worker_ss));
+	memset(msg_ss, 0, sizeof(*msg_ss));
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		add_spin_stats(msg_ss, &thread_data[index++].spin);
+		for (i = 0; i < worker_threads; i++)
+			add_spin_stats(worker_ss, &thread_data[index++].spin);
+	}
+}
+
+static void show_spin_stats(char *label, struct spin_stats *ss)
+{
+	double pct = 0;
+
+	if (ss->nr_waits)
+		pct = (double)ss->nr_spin_hits * 100 / ss->nr_waits;
+	fprintf(stderr, "%s spin: %llu waits, %.2f%% satisfied spinning, %.2f ms cpu spinning\n",
+		label, ss->nr_waits, pct, (double)ss->spin_ns / 1000000);
+}
+
+static void write_json_spin_stats(FILE *fp, struct spin_stats *ss, char *label)
+{
+	double pct = 0;
+
+	if (ss->nr_waits)
+		pct = (double)ss->nr_spin_hits * 100 / ss->nr_waits;
+	fprintf(fp, ", \"%s_spin_waits\": %llu", label, ss->nr_waits);
+	fprintf(fp, ", \"%s_spin_hit_pct\": %.2f", label, pct);
+	fprintf(fp, ", \"%s_spin_ms\": %.2f", label,
+		(double)ss->spin_ns / 1000000);
+}
+
+/*
+ * zero nr stats that add_lat() may be writing to.  All of used is
+ * cleared before any of plat, so a bucket bumped from zero after its
+ * plat is cleared sets its bit again.  The worst a race leaves behind
+ * is a bit over an empty bucket, never a sample combine_stats() skips
+ */
+static void reset_stats(struct stats *s, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		memset(s[i].used, 0, sizeof(s[i].used));
+	__sync_synchronize();
+	for (i = 0; i < nr; i++) {
+		memset(s[i].plat, 0, sizeof(s[i].plat));
+		s[i].nr_samples = 0;
+		s[i].max = 0;
+		s[i].min = 0;
+	}
+}
+
+static void reset_thread_stats(struct thread_data *thread_data)
+{
+	struct thread_data *worker;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	memset(&rps_stats, 0, sizeof(rps_stats));
+	if (dispatchers) {
+		for (i = 0; i < message_threads * nr_dispatchers; i++)
+			reset_stats(&dispatchers[i].lateness, 1);
+	}
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		thread_data[index].spin.nr_waits = 0;
+		thread_data[index].spin.nr_spin_hits = 0;
+		thread_data[index].spin.spin_ns = 0;
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			worker->avg_sched_delay = 0;
+			worker->spin.nr_waits = 0;
+			worker->spin.nr_spin_hits = 0;
+			worker->spin.spin_ns = 0;
+			reset_stats(worker->wakeup_stats, 1);
+			reset_stats(worker->request_stats, 1);
+			if (worker->wake_pos_stats)
+				reset_stats(worker->wake_pos_stats,
+					    WAKE_POS_BUCKETS);
+			if (worker->bw_stats)
+				reset_stats(worker->bw_stats, 1);
+			if (worker->dist_stats)
+				reset_stats(worker->dist_stats, NR_DIST);
+			if (worker->sleep_stats)
+				reset_stats(worker->sleep_stats, 1);
+			if (worker->breakdown_stats)
+				reset_stats(worker->breakdown_stats,
+					    NR_BREAKDOWN);
+		}
+	}
+}
+
+/*
+ * --metrics-socket.  The reporter renders the prometheus text once a
+ * second and swaps it in here, the socket thread just copies out
+ * whatever is current.  The workers never see any of this.
+ */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *metrics_text = NULL;
+static size_t metrics_len = 0;
+
+/* the quantiles we export for each latency summary */
+static double metrics_plist[] = { 50.0, 90.0, 99.0, 99.9 };
+#define NR_METRICS_PCT (sizeof(metrics_plist) / sizeof(metrics_plist[0]))
+
+/* one latency summary, for the whole run or a single message thread */
+struct metrics_summary {
+	unsigned int vals[NR_METRICS_PCT];
+	unsigned long nr_samples;
+};
+
+static void fill_metrics_summary(struct metrics_summary *ms, struct stats *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_METRICS_PCT; i++)
+		ms->vals[i] = stats_percentile(s, metrics_plist[i]);
+	ms->nr_samples = s->nr_samples;
+}
+
+/*
+ * prometheus wants every line of a metric in one block, so the totals
+ * (index 0) and each group (1..message_threads) are written together
+ */
+static void write_metrics_summary(FILE *fp, char *name,
+				  struct metrics_summary *ms)
+{
+	unsigned int i;
+	int g;
+
+	fprintf(fp, "# TYPE %s summary\n", name);
+	for (g = 0; g <= message_threads; g++) {
+		char labels[32] = "";
+
+		if (g)
+			snprintf(labels, sizeof(labels), "group=\"%d\",", g - 1);
+		for (i = 0; i < NR_METRICS_PCT; i++)
+			fprintf(fp, "%s{%squantile=\"%g\"} %u\n", name, labels,
+				metrics_plist[i] / 100, ms[g].vals[i]);
+		if (g)
+			fprintf(fp, "%s_count{group=\"%d\"} %lu\n", name,
+				g - 1, ms[g].nr_samples);
+		else
+			fprintf(fp, "%s_count %lu\n", name, ms[g].nr_samples);
+	}
+}
+
+/*
+ * called by the reporter every second.  Latencies are everything since
+ * the stats were last zeroed, the same thing the interval output shows
+ */
+static void update_metrics(struct thread_data *thread_data, double rps,
+			   unsigned long long runtime_usec)
+{
+	struct stats wakeup;
+	struct stats request;
+	struct stats group_wakeup;
+	struct stats group_request;
+	struct metrics_summary *wake_ms;
+	struct metrics_summary *req_ms;
+	unsigned long long *loops;
+	struct thread_data *worker;
+	unsigned long long message_thread_delay;
+	unsigned long long worker_thread_delay;
+	char *text;
+	char *old;
+	size_t len;
+	FILE *fp;
+	int msg_i;
+	int i;
+	int index = 0;
+
+	wake_ms = calloc(message_threads + 1, sizeof(*wake_ms));
+	req_ms = calloc(message_threads + 1, sizeof(*req_ms));
+	loops = calloc(message_threads + 1, sizeof(*loops));
+	if (!wake_ms || !req_ms || !loops) {
+		perror("unable to allocate metrics");
+		exit(1);
+	}
+
+	memset(&wakeup, 0, sizeof(wakeup));
+	memset(&request, 0, sizeof(request));
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		memset(&group_wakeup, 0, sizeof(group_wakeup));
+		memset(&group_request, 0, sizeof(group_request));
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			combine_stats(&group_wakeup, worker->wakeup_stats);
+			combine_stats(&group_request, worker->request_stats);
+			loops[msg_i + 1] += worker->loop_count;
+		}
+		combine_stats(&wakeup, &group_wakeup);
+		combine_stats(&request, &group_request);
+		loops[0] += loops[msg_i + 1];
+		fill_metrics_summary(wake_ms + msg_i + 1, &group_wakeup);
+		fill_metrics_summary(req_ms + msg_i + 1, &group_request);
+	}
+	fill_metrics_summary(wake_ms, &wakeup);
+	fill_metrics_summary(req_ms, &request);
+	collect_sched_delay(thread_data, &message_thread_delay,
+			    &worker_thread_delay);
+
+	fp = open_memstream(&text, &len);
+	if (!fp) {
+		perror("open_memstream");
+		exit(1);
+	}
+	write_metrics_summary(fp, "schbench_wakeup_latency_usec", wake_ms);
+	if (!pipe_test)
+		write_metrics_summary(fp, "schbench_request_latency_usec",
+				      req_ms);
+	fprintf(fp, "# TYPE schbench_requests_total counter\n");
+	fprintf(fp, "schbench_requests_total %llu\n", loops[0]);
+	for (msg_i = 0; msg_i < message_threads; msg_i++)
+		fprintf(fp, "schbench_requests_total{group=\"%d\"} %llu\n",
+			msg_i, loops[msg_i + 1]);
+	if (!pipe_test) {
+		fprintf(fp, "# TYPE schbench_rps gauge\n");
+		fprintf(fp, "schbench_rps %.2f\n", rps);
+	}
+	if (requests_per_sec) {
+		fprintf(fp, "# TYPE schbench_target_rps gauge\n");
+		fprintf(fp, "schbench_target_rps %d\n",
+			requests_per_sec * message_threads);
+	}
+	fprintf(fp, "# TYPE schbench_sched_delay_usec gauge\n");
+	fprintf(fp, "schbench_sched_delay_usec{thread=\"message\"} %llu\n",
+		message_thread_delay / 1000);
+	fprintf(fp, "schbench_sched_delay_usec{thread=\"worker\"} %llu\n",
+		worker_thread_delay / 1000);
+	fprintf(fp, "# TYPE schbench_runtime_seconds gauge\n");
+	fprintf(fp, "schbench_runtime_seconds %.1f\n",
+		(double)runtime_usec / USEC_PER_SEC);
+	fclose(fp);
+	free(wake_ms);
+	free(req_ms);
+	free(loops);
+
+	pthread_mutex_lock(&metrics_lock);
+	old = metrics_text;
+	metrics_text = text;
+	metrics_len = len;
+	pthread_mutex_unlock(&metrics_lock);
+	free(old);
+}
+
+/*
+ * write all of buf or give up.  MSG_NOSIGNAL so a scraper that hangs up
+ * early is just ignored instead of SIGPIPEing the benchmark
+ */
+static void write_all(int fd, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/*
+ * unlink the --metrics-socket path, but only if it really is a socket, so
+ * a typo can't delete a regular file.  Returns -1 if something else is
+ * there
+ */
+static int unlink_metrics_socket(void)
+{
+	struct stat st;
+
+	if (lstat(metrics_socket, &st)) {
+		if (errno == ENOENT)
+			return 0;
+		perror("unable to stat metrics socket");
+		exit(1);
+	}
+	if (!S_ISSOCK(st.st_mode))
+		return -1;
+	unlink(metrics_socket);
+	return 0;
+}
+
+/*
+ * the --metrics-socket server.  Anything that connects gets the current
+ * metrics text.  If the client sends an HTTP GET first, we wrap it in
+ * a minimal response so curl --unix-socket and prometheus both work.
+ */
+static void *metrics_thread(void *arg)
+{
+	int sock = (long)arg;
+	struct pollfd pfd;
+	char req[256];
+	char hdr[128];
+	char *text;
+	size_t len;
+	ssize_t ret;
+	int fd;
+
+	pthread_setname_np(pthread_self(), "schbench-metric");
+	while (1) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("metrics socket accept");
+			return NULL;
+		}
+
+		/* give the client a moment to say something */
+		ret = 0;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0)
+			ret = read(fd, req, sizeof(req) - 1);
+		req[ret > 0 ? ret : 0] = '\0';
+
+		pthread_mutex_lock(&metrics_lock);
+		len = metrics_len;
+		text = malloc(len + 1);
+		if (text && len)
+			memcpy(text, metrics_text, len);
+		pthread_mutex_unlock(&metrics_lock);
+		if (!text) {
+			close(fd);
+			continue;
+		}
+
+		if (!strncmp(req, "GET", 3)) {
+			snprintf(hdr, sizeof(hdr),
+				 "HTTP/1.0 200 OK\r\n"
+				 "Content-Type: text/plain; version=0.0.4\r\n"
+				 "Content-Length: %zu\r\n\r\n", len);
+			write_all(fd, hdr, strlen(hdr));
+		}
+		write_all(fd, text, len);
+		free(text);
+		close(fd);
+	}
+	return NULL;
+}
+
+static void start_metrics_server(void)
+{
+	struct sockaddr_un addr;
+	pthread_t tid;
+	int sock;
+	int ret;
+
+	if (strlen(metrics_socket) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "metrics socket path %s is too long\n",
+			metrics_socket);
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, metrics_socket);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("metrics socket");
+		exit(1);
+	}
+	/* a stale socket from an earlier run would make bind fail */
+	if (unlink_metrics_socket()) {
+		fprintf(stderr, "%s exists and isn't a socket, not replacing it\n",
+			metrics_socket);
+		exit(1);
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, 16) < 0) {
+		perror("unable to bind metrics socket");
+		exit(1);
+	}
+	ret = pthread_create(&tid, &thread_attr, metrics_thread,
+			     (void *)(long)sock);
+	if (ret) {
+		fprintf(stderr, "error %d from pthread_create\n", ret);
+		exit(1);
+	}
+	fprintf(stderr, "serving metrics on %s\n", metrics_socket);
+}
+
+/* the numbers --auto-warmup watches */
+enum {
+	STEADY_RPS = 0,
+	STEADY_WAKE_P50,
+	STEADY_WAKE_P99,
+	STEADY_REQ_P50,
+	STEADY_REQ_P99,
+	NR_STEADY,
+};
+
+/*
+ * latencies this small jump around by more than a few percent even when
+ * nothing is changing, so smaller values are compared as if they were
+ * this big
+ */
+#define STEADY_MIN_USEC 20
+
+/*
+ * percentiles from a handful of samples are mostly noise, so each
+ * --auto-warmup interval runs until both histograms have this many new
+ * samples, or STEADY_MAX_INTERVAL seconds go by
+ */
+#define STEADY_MIN_SAMPLES 1000
+#define STEADY_MAX_INTERVAL 10
+
+/* state for --auto-warmup */
+struct steady_state {
+	/* the cumulative histograms and counters at the start of the interval */
+	struct stats wakeup;
+	struct stats request;
+	unsigned long long loop_count;
+	unsigned long long start_usec;
+	double last[NR_STEADY];
+	int have_last;
+	int stable;
+};
+
+/* d = cur - prev, cur is a later copy of the same histogram */
+static void stats_delta(struct stats *d, struct stats *cur, struct stats *prev)
+{
+	unsigned long bits;
+	unsigned int i;
+	unsigned int w;
+
+	memset(d, 0, sizeof(*d));
+	/* somebody zeroed the stats in between, cur is all new */
+	if (cur->nr_samples < prev->nr_samples)
+		prev = d;
+	for (w = 0; w < PLAT_USED_LONGS; w++) {
+		bits = cur->used[w];
+		while (bits) {
+			i = w * BITS_PER_LONG + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			if (cur->plat[i] <= prev->plat[i])
+				continue;
+			d->plat[i] = cur->plat[i] - prev->plat[i];
+			d->used[w] |= 1UL << (i % BITS_PER_LONG);
+			d->nr_samples += d->plat[i];
+		}
+	}
+}
+
+/*
+ * called once a second, but an interval only ends once it has
+ * STEADY_MIN_SAMPLES samples or STEADY_MAX_INTERVAL seconds go by.
+ * Each interval we look at RPS and the p50/p99 of the interval's wakeup
+ * and request latencies.  Returns 1 once they have each moved less than
+ * steady_pct from the interval before for steady_intervals intervals in
+ * a row
+ */
+static int check_steady(struct steady_state *ss,
+			struct thread_data *message_threads_mem,
+			unsigned long long now_usec)
+{
+	struct stats wakeup;
+	struct stats request;
+	struct stats wakeup_delta;
+	struct stats request_delta;
+	unsigned long long loop_count;
+	unsigned long long loop_runtime;
+	unsigned long long elapsed = now_usec - ss->start_usec;
+	double cur[NR_STEADY];
+	double floor;
+	double limit;
+	int stable = 1;
+	int i;
+
+	memset(&wakeup, 0, sizeof(wakeup));
+	memset(&request, 0, sizeof(request));
+	combine_message_thread_stats(&wakeup, &request, message_threads_mem,
+				     &loop_count, &loop_runtime);
+	stats_delta(&wakeup_delta, &wakeup, &ss->wakeup);
+	stats_delta(&request_delta, &request, &ss->request);
+
+	/* keep going until we have enough to work with */
+	if (elapsed < STEADY_MAX_INTERVAL * USEC_PER_SEC &&
+	    (wakeup_delta.nr_samples < STEADY_MIN_SAMPLES ||
+	     request_delta.nr_samples < STEADY_MIN_SAMPLES))
+		return 0;
+
+	cur[STEADY_RPS] = (double)(loop_count - ss->loop_count) *
+		USEC_PER_SEC / elapsed;
+	cur[STEADY_WAKE_P50] = stats_percentile(&wakeup_delta, 50.0);
+	cur[STEADY_WAKE_P99] = stats_percentile(&wakeup_delta, 99.0);
+	cur[STEADY_REQ_P50] = stats_percentile(&request_delta, 50.0);
+	cur[STEADY_REQ_P99] = stats_percentile(&request_delta, 99.0);
+	ss->wakeup = wakeup;
+	ss->request = request;
+	ss->loop_count = loop_count;
+	ss->start_usec = now_usec;
+
+	if (!ss->have_last) {
+		ss->have_last = 1;
+		stable = 0;
+	}
+	for (i = 0; i < NR_STEADY && stable; i++) {
+		floor = i == STEADY_RPS ? 1 : STEADY_MIN_USEC;
+		limit = steady_pct / 100 *
+			(ss->last[i] > floor ? ss->last[i] : floor);
+		if (fabs(cur[i] - ss->last[i]) > limit)
+			stable = 0;
+	}
+	memcpy(ss->last, cur, sizeof(cur));
 
-	if (worker_cpus)
-		pin_worker_cpus(worker_cpus);
+	/* -A is still moving the RPS around */
+	if (auto_rps && !auto_rps_target_hit)
+		stable = 0;
 
-	for (i = 0; i < worker_threads; i++) {
-		pthread_t tid;
-		unsigned long alloc_size;
+	if (stable)
+		ss->stable++;
+	else
+		ss->stable = 0;
+	return ss->stable >= steady_intervals;
+}
 
-		/* Allocate based on private_matrix_size if using split, else use matrix_size */
-		if (private_matrix_size > 0)
-			alloc_size = private_matrix_size;
-		else
-			alloc_size = matrix_size;
+/* where knob is t seconds into phase p */
+static double phase_knob(struct phase *p, int knob, double t)
+{
+	double from = p->from[knob];
+	double to = p->to[knob];
+
+	switch (p->shape) {
+	case SHAPE_RAMP:
+		return from + (to - from) * t / p->duration;
+	case SHAPE_SQUARE:
+		return fmod(t, p->period) < p->period / 2 ? from : to;
+	case SHAPE_SINE:
+		return from + (to - from) * (1 - cos(2 * M_PI * t / p->period)) / 2;
+	}
+	/* step: from for the first half, then to */
+	return t < p->duration / 2.0 ? from : to;
+}
 
-		worker_threads_mem[i].data = malloc(3 * sizeof(unsigned long) * alloc_size * alloc_size);
-		if (!worker_threads_mem[i].data) {
-			perror("unable to allocate ram");
-			pthread_exit((void *)-ENOMEM);
-		}
+static void apply_phase(struct phase *p, double t)
+{
+	int threads;
+	int rps;
 
-		worker_threads_mem[i].msg_thread = td;
-		ret = pthread_create(&tid, NULL, worker_thread,
-				     worker_threads_mem + i);
-		if (ret) {
-			fprintf(stderr, "error %d from pthread_create\n", ret);
-			exit(1);
+	if (p->set[PHASE_RPS]) {
+		rps = phase_knob(p, PHASE_RPS, t) / message_threads + 0.5;
+		requests_per_sec = rps > 0 ? rps : 1;
+	}
+	if (p->set[PHASE_OPS])
+		operations = phase_knob(p, PHASE_OPS, t) + 0.5;
+	if (p->set[PHASE_SLEEP])
+		sleep_usec = phase_knob(p, PHASE_SLEEP, t) + 0.5;
+	if (p->set[PHASE_THREADS]) {
+		threads = phase_knob(p, PHASE_THREADS, t) + 0.5;
+		if (threads < 1)
+			threads = 1;
+		if (threads > worker_threads)
+			threads = worker_threads;
+		if (threads != active_workers) {
+			active_workers = threads;
+			wake_gen_all(&phase_gen);
 		}
-		worker_threads_mem[i].tid = tid;
-		worker_threads_mem[i].index = i;
 	}
+}
 
-	if (message_cpus)
-		pin_message_cpu(td->index, message_cpus);
+/*
+ * walks through the --phases schedule, turning the knobs every
+ * PHASE_TICK_MS.  At the end of each phase the histograms are diffed
+ * against the start of the phase to get its own stats
+ */
+static void *phase_thread(void *arg)
+{
+	struct thread_data *message_threads_mem = arg;
+	struct stats *snap;
+	struct stats *prev_wakeup;
+	struct stats *prev_request;
+	struct stats *cur_wakeup;
+	struct stats *cur_request;
+	struct stats *delta;
+	unsigned long long prev_loops;
+	unsigned long long loops;
+	unsigned long long loop_runtime;
+	unsigned long long phase_start;
+	unsigned long long phase_end;
+	unsigned long long now;
+	unsigned long long left;
+	struct phase *p;
+	unsigned int j;
+	int i;
 
-	if (requests_per_sec)
-		run_rps_thread(worker_threads_mem);
-	else
-		run_msg_thread(td);
+	pthread_setname_np(pthread_self(), "schbench-phase");
+	snap = calloc(5, sizeof(*snap));
+	if (!snap) {
+		perror("unable to allocate phase stats");
+		exit(1);
+	}
+	prev_wakeup = snap;
+	prev_request = snap + 1;
+	cur_wakeup = snap + 2;
+	cur_request = snap + 3;
+	delta = snap + 4;
+
+	combine_message_thread_stats(prev_wakeup, prev_request,
+				     message_threads_mem, &prev_loops,
+				     &loop_runtime);
+	phase_end = nsec_now();
+	for (i = 0; i < nr_phases && !stopping; i++) {
+		p = phases + i;
+		phase_start = phase_end;
+		phase_end = phase_start + p->duration * NSEC_PER_SEC;
+		fprintf(stderr, "phase %d: %u seconds\n", i, p->duration);
+
+		while (!stopping) {
+			now = nsec_now();
+			if (now >= phase_end)
+				break;
+			apply_phase(p, (double)(now - phase_start) / NSEC_PER_SEC);
+			left = (phase_end - now) / 1000;
+			usleep(left < PHASE_TICK_MS * 1000 ? left : PHASE_TICK_MS * 1000);
+		}
 
-	for (i = 0; i < worker_threads; i++) {
-		fpost(&worker_threads_mem[i].futex);
-		pthread_join(worker_threads_mem[i].tid, NULL);
+		memset(cur_wakeup, 0, sizeof(*cur_wakeup));
+		memset(cur_request, 0, sizeof(*cur_request));
+		combine_message_thread_stats(cur_wakeup, cur_request,
+					     message_threads_mem, &loops,
+					     &loop_runtime);
+		p->seconds = (double)(nsec_now() - phase_start) / NSEC_PER_SEC;
+		p->rps = (loops - prev_loops) / p->seconds;
+		stats_delta(delta, cur_wakeup, prev_wakeup);
+		p->nr_samples = delta->nr_samples;
+		for (j = 0; j < NR_BASELINE_PCT; j++)
+			p->wakeup[j] = stats_percentile(delta, baseline_plist[j]);
+		stats_delta(delta, cur_request, prev_request);
+		for (j = 0; j < NR_BASELINE_PCT; j++)
+			p->request[j] = stats_percentile(delta, baseline_plist[j]);
+		*prev_wakeup = *cur_wakeup;
+		*prev_request = *cur_request;
+		prev_loops = loops;
+		nr_phases_done++;
 	}
+
+	/* parked workers need a kick to notice we're stopping */
+	while (!stopping)
+		usleep(PHASE_TICK_MS * 1000);
+	wake_gen_all(&phase_gen);
+	free(snap);
 	return NULL;
 }
 
-static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
+static void show_phases(void)
+{
+	struct phase *p;
+	int i;
 
-static double pretty_size(double number, char **str)
+	for (i = 0; i < nr_phases_done; i++) {
+		p = phases + i;
+		/* baseline_plist is p50, p90, p99, p99.9 */
+		fprintf(stderr, "phase %d (%.1fs): rps %.2f wakeup p50 %u p99 %u request p50 %u p99 %u (usec)\n",
+			i, p->seconds, p->rps, p->wakeup[0], p->wakeup[2],
+			p->request[0], p->request[2]);
+	}
+}
+
+/* sleep until nsec_now() reaches ns.  Returns 0 if we're stopping */
+static int sleep_until(unsigned long long ns)
 {
-	int divs = 0;
+	unsigned long long now;
+
+	while (!stopping) {
+		now = nsec_now();
+		if (now >= ns)
+			return 1;
+		now = (ns - now) / 1000;
+		usleep(now < USEC_PER_SEC / 10 ? now : USEC_PER_SEC / 10);
+	}
+	return 0;
+}
 
-	while(number >= 1024) {
-		if (units[divs + 1] == NULL)
-			break;
-		divs++;
-		number /= 1024;
+/* requests --burst has queued on top of the dispatchers */
+static unsigned long long burst_sent = 0;
+
+/* returns the requests finished so far */
+static unsigned long long recovery_combine(struct recovery *rec,
+					   struct thread_data *message_threads_mem)
+{
+	unsigned long long loop_count;
+	unsigned long long loop_runtime;
+	unsigned long long sent = burst_sent;
+	int i;
+
+	/* read sent first, so the backlog can't go negative */
+	for (i = 0; dispatchers && i < message_threads * nr_dispatchers; i++)
+		sent += dispatchers[i].sent;
+	__sync_synchronize();
+	memset(rec->cur, 0, 2 * sizeof(*rec->cur));
+	combine_message_thread_stats(rec->cur, rec->cur + 1,
+				     message_threads_mem, &loop_count,
+				     &loop_runtime);
+	rec->backlog = dispatchers ? sent - loop_count : 0;
+	return loop_count;
+}
+
+/* start a new window here */
+static void recovery_mark(struct recovery *rec,
+			  struct thread_data *message_threads_mem)
+{
+	if (!rec->snap) {
+		/* snap, cur and delta, each a wakeup and request pair */
+		rec->snap = calloc(6, sizeof(*rec->snap));
+		if (!rec->snap) {
+			perror("unable to allocate recovery stats");
+			exit(1);
+		}
+		rec->cur = rec->snap + 2;
+		rec->delta = rec->snap + 4;
 	}
-	*str = units[divs];
-	return number;
+	rec->loops = recovery_combine(rec, message_threads_mem);
+	rec->mark_ns = nsec_now();
+	memcpy(rec->snap, rec->cur, 2 * sizeof(*rec->snap));
 }
 
 /*
- * we want to calculate RPS more often than the full message stats,
- * so this is a less expensive walk through all the message threads
- * to pull that out
+ * the percentiles since the last mark, which moves up to now.  If there
+ * are fewer than min_samples requests, returns 0 and leaves the mark
+ * where it was.  Busy workers don't sleep, so there may not be any
+ * wakeups at all
  */
-static void combine_message_thread_rps(struct thread_data *thread_data,
-				       unsigned long long *loop_count)
+static int recovery_window(struct recovery *rec,
+			   struct thread_data *message_threads_mem,
+			   unsigned int *vals, unsigned long min_samples)
 {
-	struct thread_data *worker;
+	unsigned long long loops = recovery_combine(rec, message_threads_mem);
+	unsigned long long now = nsec_now();
+
+	stats_delta(rec->delta, rec->cur, rec->snap);
+	stats_delta(rec->delta + 1, rec->cur + 1, rec->snap + 1);
+	if (rec->delta[1].nr_samples < min_samples)
+		return 0;
+	vals[REC_WAKE_P50] = stats_percentile(rec->delta, 50.0);
+	vals[REC_WAKE_P99] = stats_percentile(rec->delta, 99.0);
+	vals[REC_REQ_P50] = stats_percentile(rec->delta + 1, 50.0);
+	vals[REC_REQ_P99] = stats_percentile(rec->delta + 1, 99.0);
+	rec->rps = now > rec->mark_ns ? (double)(loops - rec->loops) *
+		NSEC_PER_SEC / (now - rec->mark_ns) : 0;
+	rec->loops = loops;
+	rec->mark_ns = now;
+	memcpy(rec->snap, rec->cur, 2 * sizeof(*rec->snap));
+	return 1;
+}
+
+/* zero every worker's peak_pending before an event */
+static void clear_peak_pending(struct thread_data *message_threads_mem)
+{
+	int i;
+
+	for (i = 0; i < message_threads * worker_threads + message_threads; i++)
+		message_threads_mem[i].peak_pending = 0;
+}
+
+/*
+ * sleep until event_ns, taking the second before it as what we have to
+ * get back to afterwards.  Returns 0 if we're stopping
+ */
+static int recovery_reference(struct recovery *rec,
+			      struct thread_data *message_threads_mem,
+			      struct recovery_event *ev,
+			      unsigned long long event_ns)
+{
+	if (!sleep_until(event_ns - NSEC_PER_SEC))
+		return 0;
+	recovery_mark(rec, message_threads_mem);
+	if (!sleep_until(event_ns))
+		return 0;
+	recovery_window(rec, message_threads_mem, rec->ref, 0);
+	rec->ref_backlog = rec->backlog;
+	memset(ev, 0, sizeof(*ev));
+	ev->ref_rps = rec->rps;
+	ev->min_rps = -1;
+	clear_peak_pending(message_threads_mem);
+	return 1;
+}
+
+/*
+ * watch the latencies after an event that started at start_ns, filling
+ * in the timeline and the worst of it in ev until deadline_ns.
+ * ev->recovery_ms is how long it took to get back to rec->ref, or -1.
+ * Nothing before busy_ns (the end of a burst) counts as recovered
+ */
+static void track_recovery(struct recovery *rec,
+			   struct thread_data *message_threads_mem,
+			   struct recovery_event *ev,
+			   unsigned long long start_ns,
+			   unsigned long long busy_ns,
+			   unsigned long long deadline_ns)
+{
+	unsigned int vals[NR_REC];
+	unsigned long long next = start_ns;
+	unsigned long long now;
+	unsigned int limit;
+	double recovered = -1;
+	int slot;
+	int ok;
 	int i;
+
+	while (1) {
+		next += TIMELINE_SLOT_MS * 1000000ULL;
+		if (next > deadline_ns || !sleep_until(next))
+			break;
+		if (!recovery_window(rec, message_threads_mem, vals,
+				     RECOVERY_MIN_SAMPLES))
+			continue;
+		now = nsec_now();
+		slot = (next - start_ns) / (TIMELINE_SLOT_MS * 1000000ULL) - 1;
+		if (slot < TIMELINE_MAX_SLOTS) {
+			rec->wakeup_sum[slot] += vals[REC_WAKE_P99];
+			rec->request_sum[slot] += vals[REC_REQ_P99];
+			rec->rps_sum[slot] += rec->rps;
+			rec->backlog_sum[slot] += rec->backlog;
+			rec->slot_events[slot]++;
+		}
+		if (vals[REC_WAKE_P99] > ev->worst_wakeup_p99)
+			ev->worst_wakeup_p99 = vals[REC_WAKE_P99];
+		if (vals[REC_REQ_P99] > ev->worst_request_p99)
+			ev->worst_request_p99 = vals[REC_REQ_P99];
+		if (ev->min_rps < 0 || rec->rps < ev->min_rps)
+			ev->min_rps = rec->rps;
+		if (recovered >= 0 || now < busy_ns)
+			continue;
+
+		/* one request per active worker is just the normal load */
+		ok = rec->backlog <= rec->ref_backlog +
+			message_threads * active_workers;
+		for (i = 0; i < NR_REC; i++) {
+			limit = rec->ref[i] * RECOVERY_PCT / 100;
+			if (limit < STEADY_MIN_USEC)
+				limit = STEADY_MIN_USEC;
+			if (vals[i] > rec->ref[i] + limit)
+				ok = 0;
+		}
+		if (ok)
+			recovered = (double)(now - start_ns) / 1000000;
+	}
+	ev->recovery_ms = recovered;
+	if (ev->min_rps < 0)
+		ev->min_rps = 0;
+}
+
+/* fill in the peak pending numbers and add ev to rec->events */
+static void record_recovery(struct recovery *rec,
+			    struct thread_data *message_threads_mem,
+			    struct recovery_event *ev)
+{
+	struct thread_data *worker;
+	unsigned long long sum = 0;
 	int msg_i;
-	int index = 0;
+	int i;
 
-	*loop_count = 0;
 	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
+		worker = message_threads_mem + msg_i * (worker_threads + 1) + 1;
 		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			*loop_count += worker->loop_count;
+			if (worker[i].peak_pending > ev->peak_pending)
+				ev->peak_pending = worker[i].peak_pending;
+			sum += worker[i].peak_pending;
 		}
 	}
+	ev->mean_peak_pending = (double)sum / (message_threads * worker_threads);
+
+	rec->events = realloc(rec->events,
+			      (rec->nr_events + 1) * sizeof(*rec->events));
+	if (!rec->events) {
+		perror("unable to allocate recovery events");
+		exit(1);
+	}
+	rec->events[rec->nr_events++] = *ev;
+
+	fprintf(stderr, "%s %d: ", rec->name, rec->nr_events);
+	if (ev->recovery_ms >= 0)
+		fprintf(stderr, "recovered in %.0f ms", ev->recovery_ms);
+	else
+		fprintf(stderr, "did not recover");
+	fprintf(stderr, ", worst p99 wakeup %u request %u usec, min rps %.0f (was %.0f), peak pending %u\n",
+		ev->worst_wakeup_p99, ev->worst_request_p99, ev->min_rps,
+		ev->ref_rps, ev->peak_pending);
+}
+
+/* the nth active worker across every group, for --burst */
+static struct thread_data *burst_worker(struct thread_data *message_threads_mem,
+					unsigned int n)
+{
+	unsigned int active = active_workers;
+
+	n %= message_threads * active;
+	return message_threads_mem + (n / active) * (worker_threads + 1) + 1 +
+		n % active;
 }
 
 /*
- * read /proc/pid/schedstat for each of our threads and average out the delay
- * recorded on the kernel side for scheduling us.  This should be similar
- * to the delays we record between wakeup and actually running, but differences
- * can expose problems in different parts of the wakeup paths
+ * --burst.  Every burst_period seconds, queue burst_requests extra
+ * requests spread over burst_window_ms, and then see how long it takes
+ * the latencies to get back to where they were
  */
-static void collect_sched_delay(struct thread_data *thread_data,
-				unsigned long long *message_thread_delay_ret,
-				unsigned long long *worker_thread_delay_ret)
+static void *burst_thread(void *arg)
+{
+	struct thread_data *message_threads_mem = arg;
+	struct recovery *rec = &burst_recovery;
+	struct recovery_event ev;
+	unsigned long long period = burst_period * NSEC_PER_SEC;
+	unsigned long long window = burst_window_ms * 1000000;
+	unsigned long long start = nsec_now();
+	unsigned long long burst_start;
+	unsigned long long deadline;
+	unsigned long long now;
+	struct timeval tv;
+	struct timespec ts;
+	unsigned int cur = 0;
+	unsigned int i;
+	int n;
+
+	pthread_setname_np(pthread_self(), "schbench-burst");
+	for (n = 1; !stopping; n++) {
+		burst_start = start + n * period;
+		if (!recovery_reference(rec, message_threads_mem, &ev,
+					burst_start))
+			break;
+
+		burst_start = nsec_now();
+		for (i = 0; i < burst_requests && !stopping; i++) {
+			deadline = burst_start + window * i / burst_requests;
+			now = nsec_now();
+			if (deadline > now + PACE_MIN_SLEEP_NS) {
+				ts = ns_to_timespec(deadline);
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&ts, NULL);
+			}
+			gettimeofday(&tv, NULL);
+			queue_request(burst_worker(message_threads_mem, cur++),
+				      &tv);
+			burst_sent++;
+		}
+
+		deadline = start + (n + 1) * period - NSEC_PER_SEC;
+		track_recovery(rec, message_threads_mem, &ev, burst_start,
+			       burst_start + window, deadline);
+		if (stopping)
+			break;
+		record_recovery(rec, message_threads_mem, &ev);
+	}
+	return NULL;
+}
+
+/*
+ * --churn.  Every churn_period seconds we change the affinity of every
+ * worker at once, like a container cpuset resize, and watch how long the
+ * scheduler takes to settle.  resize alternates between the first
+ * churn_pct percent of the worker cpus and all of them, shuffle pins each
+ * worker to a random one of them, a different one each time.  Growing
+ * back puts each worker's own mask from --pin or -W back, and shrinking
+ * keeps workers inside their own mask when it overlaps the smaller set.
+ */
+static void *churn_thread(void *arg)
 {
+	struct thread_data *message_threads_mem = arg;
+	struct recovery *rec = &churn_recovery;
+	struct recovery_event ev;
 	struct thread_data *worker;
-	unsigned long long message_thread_delay = 0;
-	unsigned long long worker_thread_delay = 0;
-	unsigned long long delay;
-	int i;
+	cpu_set_t *orig;
+	unsigned long long period = churn_period * NSEC_PER_SEC;
+	unsigned long long start = nsec_now();
+	unsigned long long event_ns;
+	unsigned long long apply_ns;
+	unsigned short rand_state[3] = { 0x5eed, start, start >> 16 };
+	cpu_set_t base;
+	cpu_set_t shrink;
+	cpu_set_t mask;
+	int *cpus;
+	int nr_cpus = 0;
+	int nr_mask;
 	int msg_i;
-	int index = 0;
+	int w;
+	int i;
+	int n;
 
+	pthread_setname_np(pthread_self(), "schbench-churn");
+	orig = calloc(message_threads * worker_threads, sizeof(*orig));
+	if (!orig) {
+		perror("unable to allocate churn masks");
+		exit(1);
+	}
 	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		delay = read_sched_delay(thread_data[index].sys_tid);
-		message_thread_delay += delay;
-		index++;
+		worker = message_threads_mem + msg_i * (worker_threads + 1) + 1;
 		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			delay = read_sched_delay(worker->sys_tid);
-			worker_thread_delay += delay;
+			if (sched_getaffinity(worker[i].sys_tid, sizeof(*orig),
+					      orig + msg_i * worker_threads + i)) {
+				perror("sched_getaffinity");
+				exit(1);
+			}
+		}
+	}
+	if (worker_cpus)
+		base = *worker_cpus;
+	else if (sched_getaffinity(0, sizeof(base), &base)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+	cpus = calloc(CPU_SETSIZE, sizeof(*cpus));
+	if (!cpus) {
+		perror("unable to allocate churn cpus");
+		exit(1);
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &base))
+			cpus[nr_cpus++] = i;
+	}
+
+	for (n = 1; !stopping; n++) {
+		event_ns = start + n * period;
+		if (!recovery_reference(rec, message_threads_mem, &ev, event_ns))
+			break;
+
+		/* odd events shrink, even ones grow back */
+		nr_mask = nr_cpus;
+		if (churn_mode == CHURN_RESIZE && (n & 1)) {
+			nr_mask = nr_cpus * churn_pct / 100;
+			if (nr_mask < 1)
+				nr_mask = 1;
+		}
+		CPU_ZERO(&shrink);
+		for (i = 0; i < nr_mask; i++)
+			CPU_SET(cpus[i], &shrink);
+
+		event_ns = nsec_now();
+		for (msg_i = 0; msg_i < message_threads; msg_i++) {
+			worker = message_threads_mem + msg_i * (worker_threads + 1) + 1;
+			for (i = 0; i < worker_threads; i++) {
+				w = msg_i * worker_threads + i;
+				if (churn_mode == CHURN_SHUFFLE) {
+					CPU_ZERO(&mask);
+					CPU_SET(cpus[(int)(erand48(rand_state) * nr_cpus)],
+						&mask);
+				} else if (nr_mask == nr_cpus) {
+					mask = orig[w];
+				} else {
+					/* stay inside our own cpus if any are left */
+					CPU_AND(&mask, orig + w, &shrink);
+					if (!CPU_COUNT(&mask))
+						mask = shrink;
+				}
+				/* a worker that already exited is fine */
+				sched_setaffinity(worker[i].sys_tid, sizeof(mask),
+						  &mask);
+			}
+		}
+		apply_ns = nsec_now() - event_ns;
+		if (churn_mode == CHURN_SHUFFLE)
+			fprintf(stderr, "churn %d: shuffled workers over %d cpus in %.2f ms\n",
+				n, nr_cpus, (double)apply_ns / 1000000);
+		else
+			fprintf(stderr, "churn %d: resized to %d of %d cpus in %.2f ms\n",
+				n, nr_mask, nr_cpus, (double)apply_ns / 1000000);
+
+		track_recovery(rec, message_threads_mem, &ev, event_ns, event_ns,
+			       start + (n + 1) * period - NSEC_PER_SEC);
+		if (stopping)
+			break;
+		record_recovery(rec, message_threads_mem, &ev);
+	}
+	free(orig);
+	free(cpus);
+	return NULL;
+}
+
+/* a few thousand rounds of xorshift, each one counts as an op */
+static unsigned long long antag_cpu(struct antag_thread *at)
+{
+	unsigned long x = at->seed;
+	int i;
+
+	for (i = 0; i < 4096; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+	}
+	at->seed = x;
+	return 4096;
+}
+
+/* copy one half of the buffer over the other, returns bytes moved */
+static unsigned long long antag_mem(struct antag_thread *at)
+{
+	size_t half = at->antag->bytes / 2;
+
+	memcpy(at->buf + half, at->buf, half);
+	return half * 2;
+}
+
+/*
+ * dirty one word in every cacheline of an LLC sized buffer, starting
+ * from a random line each time.  Returns the bytes of cache touched
+ */
+static unsigned long long antag_cache(struct antag_thread *at)
+{
+	size_t lines = at->antag->bytes / CACHELINE_SIZE;
+	size_t start = (at->seed++ * 2654435761UL) % lines;
+	size_t i;
+
+	for (i = 0; i < lines; i++)
+		at->buf[((start + i) % lines) * CACHELINE_SIZE]++;
+	return lines * CACHELINE_SIZE;
+}
+
+#define ANTAG_SPAWN_BATCH 16
+
+static void *antag_spawn_child(void *arg)
+{
+	return arg;
+}
+
+/* start a batch of threads that exit right away, returns how many */
+static unsigned long long antag_spawn(void)
+{
+	pthread_t tids[ANTAG_SPAWN_BATCH];
+	int ret;
+	int i;
+
+	for (i = 0; i < ANTAG_SPAWN_BATCH; i++) {
+		ret = pthread_create(tids + i, &thread_attr, antag_spawn_child,
+				     NULL);
+		if (ret)
+			break;
+	}
+	ret = i;
+	for (i = 0; i < ret; i++)
+		pthread_join(tids[i], NULL);
+	return ret;
+}
+
+static void *antagonist_thread(void *arg)
+{
+	struct antag_thread *at = arg;
+	struct antagonist *a = at->antag;
+	struct sched_param param = { .sched_priority = 0 };
+
+	pthread_setname_np(pthread_self(), "schbench-antag");
+	if (a->policy != SCHED_OTHER &&
+	    sched_setscheduler(0, a->policy, &param)) {
+		perror("sched_setscheduler");
+		exit(1);
+	}
+	/* nice is per thread on linux */
+	if (a->nice && setpriority(PRIO_PROCESS, get_sys_tid(), a->nice)) {
+		perror("setpriority");
+		exit(1);
+	}
+
+	while (!a->stop) {
+		switch (a->type) {
+		case ANTAG_CPU:
+			at->ops += antag_cpu(at);
+			break;
+		case ANTAG_MEM:
+			at->ops += antag_mem(at);
+			break;
+		case ANTAG_CACHE:
+			at->ops += antag_cache(at);
+			break;
+		case ANTAG_SPAWN:
+			at->ops += antag_spawn();
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void start_antagonist(struct antagonist *a)
+{
+	struct antag_thread *at;
+	int ret;
+	int i;
+
+	a->stop = 0;
+	a->start_ns = nsec_now();
+	for (i = 0; i < a->count; i++) {
+		at = a->threads + i;
+		at->ops = 0;
+		ret = pthread_create(&at->tid, &thread_attr, antagonist_thread,
+				     at);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+}
+
+/* stop the threads, returns the ops they did and how long they ran */
+static unsigned long long stop_antagonist(struct antagonist *a,
+					  unsigned long long *run_ns)
+{
+	unsigned long long ops = 0;
+	int i;
+
+	a->stop = 1;
+	for (i = 0; i < a->count; i++) {
+		pthread_join(a->threads[i].tid, NULL);
+		ops += a->threads[i].ops;
+	}
+	*run_ns = nsec_now() - a->start_ns;
+	return ops;
+}
+
+#define ANTAG_SOLO_MS 500
+
+/*
+ * allocate each antagonist's threads and buffers, and run each one alone
+ * for a bit so we know how much throughput it keeps once schbench is
+ * running next to it
+ */
+static void setup_antagonists(void)
+{
+	struct antagonist *a;
+	struct antag_thread *at;
+	unsigned long long ops;
+	unsigned long long ns;
+	size_t llc = read_llc_bytes(32 * 1024 * 1024);
+	int i;
+	int j;
+
+	for (i = 0; i < nr_antagonists; i++) {
+		a = antagonists + i;
+		if (a->type == ANTAG_MEM)
+			a->bytes = 8 * llc;
+		else if (a->type == ANTAG_CACHE)
+			a->bytes = llc;
+		a->threads = calloc(a->count, sizeof(*a->threads));
+		if (!a->threads) {
+			perror("unable to allocate antagonists");
+			exit(1);
+		}
+		for (j = 0; j < a->count; j++) {
+			at = a->threads + j;
+			at->antag = a;
+			at->seed = j + 1;
+			if (!a->bytes)
+				continue;
+			at->buf = malloc(a->bytes);
+			if (!at->buf) {
+				perror("unable to allocate antagonist buffer");
+				exit(1);
+			}
+			memset(at->buf, j, a->bytes);
 		}
+
+		start_antagonist(a);
+		usleep(ANTAG_SOLO_MS * 1000);
+		ops = stop_antagonist(a, &ns);
+		a->solo_rate = antag_rate(ops, ns, a->type);
 	}
-	*message_thread_delay_ret = message_thread_delay / message_threads;
-	*worker_thread_delay_ret = worker_thread_delay / (message_threads * worker_threads);
 }
 
-static void combine_message_thread_stats(struct stats *wakeup_stats,
-					 struct stats *request_stats,
-					struct thread_data *thread_data,
-					unsigned long long *loop_count,
-					unsigned long long *loop_runtime)
+static void start_antagonists(void)
 {
-	struct thread_data *worker;
 	int i;
-	int msg_i;
-	int index = 0;
 
-	*loop_count = 0;
-	*loop_runtime = 0;
-	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
-		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			combine_stats(wakeup_stats, &worker->wakeup_stats);
-			combine_stats(request_stats, &worker->request_stats);
-			*loop_count += worker->loop_count;
-			*loop_runtime += worker->runtime;
-		}
+	for (i = 0; i < nr_antagonists; i++)
+		start_antagonist(antagonists + i);
+}
+
+static void stop_antagonists(void)
+{
+	unsigned long long ns;
+	int i;
+
+	for (i = 0; i < nr_antagonists; i++) {
+		antagonists[i].ops += stop_antagonist(antagonists + i, &ns);
+		antagonists[i].run_ns += ns;
 	}
 }
 
-static void reset_thread_stats(struct thread_data *thread_data)
+static void show_antagonists(void)
 {
-	struct thread_data *worker;
+	struct antagonist *a;
+	double rate;
 	int i;
-	int msg_i;
-	int index = 0;
 
-	memset(&rps_stats, 0, sizeof(rps_stats));
-	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
-		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			worker->avg_sched_delay = 0;
-			memset(&worker->wakeup_stats, 0, sizeof(worker->wakeup_stats));
-			memset(&worker->request_stats, 0, sizeof(worker->request_stats));
-		}
+	for (i = 0; i < nr_antagonists; i++) {
+		a = antagonists + i;
+		rate = antag_rate(a->ops, a->run_ns, a->type);
+		fprintf(stderr, "antagonist %s x%d %s nice %d: %.1f %s, %.1f%% of %.1f alone\n",
+			antag_names[a->type], a->count, antag_policy_name(a),
+			a->nice, rate, antag_units[a->type],
+			a->solo_rate ? rate * 100 / a->solo_rate : 0,
+			a->solo_rate);
 	}
 }
 
-/* runtime from the command line is in seconds.  Sleep until its up */
-static void sleep_for_runtime(struct thread_data *message_threads_mem)
+/*
+ * runtime from the command line is in seconds.  Sleep until its up and
+ * return how long we actually slept.  warm is set for --iterations after
+ * the first when the threads kept running, those skip the warmup and
+ * start measuring right away
+ */
+static unsigned long long sleep_for_runtime(struct thread_data *message_threads_mem,
+					    int warm)
 {
+	struct steady_state *steady = NULL;
 	struct timeval now;
 	struct timeval zero_time;
 	struct timeval last_calc;
@@ -1728,6 +7088,11 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 	struct timeval start;
 	struct stats wakeup_stats;
 	struct stats request_stats;
+	struct stats bw_stats;
+	struct stats sleep_stats;
+	struct stats lateness_stats;
+	unsigned long long dropped;
+	unsigned long long overruns;
 	unsigned long long last_loop_count = 0;
 	unsigned long long loop_count;
 	unsigned long long loop_runtime;
@@ -1739,17 +7104,33 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 	unsigned long long zero_usec = zerotime * USEC_PER_SEC;
 	unsigned long long message_thread_delay;
 	unsigned long long worker_thread_delay;
+	double busiest;
+	double rps = 0;
 	int warmup_done = 0;
-
-	/* if we're autoscaling RPS */
-	int proc_stat_fd = -1;
-	unsigned long long total_time = 0;
-	unsigned long long total_idle = 0;
+	int rps_stats_reset = 0;
 	int done = 0;
 
 	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
+	if (warm) {
+		reset_thread_stats(message_threads_mem);
+		/* loop_count keeps going, RPS starts from where it is now */
+		combine_message_thread_rps(message_threads_mem,
+					   &last_loop_count);
+		warmup_done = 1;
+		if (auto_warmup && measure_sec)
+			runtime_usec = measure_sec * USEC_PER_SEC;
+	} else if (auto_warmup) {
+		steady = calloc(1, sizeof(*steady));
+		if (!steady) {
+			perror("unable to allocate steady state");
+			exit(1);
+		}
+	}
 	gettimeofday(&start, NULL);
 	last_calc = start;
+	if (steady)
+		combine_message_thread_rps(message_threads_mem,
+					   &steady->loop_count);
 	last_rps_calc = start;
 	zero_time = start;
 
@@ -1768,8 +7149,6 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 			zero_time = now;
 			reset_thread_stats(message_threads_mem);
 		} else if (!pipe_test) {
-			double rps;
-
 			/* count our RPS every round */
 			delta = tvdelta(&last_rps_calc, &now);
 
@@ -1778,9 +7157,28 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 			last_loop_count = loop_count;
 			last_rps_calc = now;
 
+			/* -A only starts counting RPS once the controller settles */
+			if (auto_rps && auto_rps_target_hit && !rps_stats_reset) {
+				memset(&rps_stats, 0, sizeof(rps_stats));
+				rps_stats_reset = 1;
+			}
 			if (!auto_rps || auto_rps_target_hit)
 				add_lat(&rps_stats, isfinite(rps) ? rps : 0);
 
+			if (steady && !warmup_done && !done &&
+			    check_steady(steady, message_threads_mem,
+					 runtime_delta)) {
+				warmup_done = 1;
+				steady_usec = runtime_delta;
+				fprintf(stderr, "steady state after %.1fs, zeroing stats\n",
+					(double)runtime_delta / USEC_PER_SEC);
+				zero_time = now;
+				reset_thread_stats(message_threads_mem);
+				if (measure_sec)
+					runtime_usec = runtime_delta +
+						measure_sec * USEC_PER_SEC;
+			}
+
 			delta = tvdelta(&last_calc, &now);
 			if (delta >= interval_usec) {
 				memset(&wakeup_stats, 0, sizeof(wakeup_stats));
@@ -1803,6 +7201,41 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 					       "Request Latencies", "usec",
 					       runtime_delta / USEC_PER_SEC,
 					       PLIST_FOR_LAT, PLIST_99);
+				if (work_kernel != KERNEL_MATRIX) {
+					memset(&bw_stats, 0, sizeof(bw_stats));
+					combine_worker_stats(&bw_stats, WORKER_BW,
+							     message_threads_mem);
+					show_latencies(&bw_stats,
+						       "Request Bandwidth", "MB/s",
+						       runtime_delta / USEC_PER_SEC,
+						       PLIST_FOR_RPS, PLIST_50);
+				}
+				memset(&sleep_stats, 0, sizeof(sleep_stats));
+				combine_worker_stats(&sleep_stats, WORKER_SLEEP,
+						     message_threads_mem);
+				if (sleep_stats.nr_samples)
+					show_latencies(&sleep_stats,
+						       "Oversleep Latencies", "usec",
+						       runtime_delta / USEC_PER_SEC,
+						       PLIST_FOR_LAT, PLIST_99);
+				if (requests_per_sec) {
+					memset(&lateness_stats, 0,
+					       sizeof(lateness_stats));
+					combine_dispatcher_stats(&lateness_stats,
+								 &dropped,
+								 &overruns);
+					if (pacing != PACE_BURST)
+						show_latencies(&lateness_stats,
+							       "Dispatch Lateness", "usec",
+							       runtime_delta / USEC_PER_SEC,
+							       PLIST_FOR_LAT, PLIST_99);
+					busiest = busiest_dispatcher();
+					if (dispatch_worth_reporting(dropped, overruns,
+								     busiest))
+						fprintf(stderr,
+							"dispatch: dropped %llu overruns %llu busiest %.1f%% cpu\n",
+							dropped, overruns, busiest);
+				}
 				show_latencies(&rps_stats, "RPS", "requests",
 					       runtime_delta / USEC_PER_SEC,
 					       PLIST_FOR_RPS, PLIST_50);
@@ -1813,6 +7246,11 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 				fprintf(stderr, "current rps: %.2f\n", rps);
 			}
 		}
+		if (metrics_socket)
+			update_metrics(message_threads_mem, isfinite(rps) ? rps : 0,
+				       runtime_delta);
+		if (flight_fp)
+			flush_flight_dumps();
 		if (zero_usec) {
 			unsigned long long zero_delta;
 			zero_delta = tvdelta(&zero_time, &now);
@@ -1821,17 +7259,291 @@ static void sleep_for_runtime(struct thread_data *message_threads_mem)
 				reset_thread_stats(message_threads_mem);
 			}
 		}
-		if (auto_rps)
-			auto_scale_rps(&proc_stat_fd, &total_time, &total_idle);
 		if (!done)
 			sleep(1);
 	}
-	if (proc_stat_fd >= 0)
-		close(proc_stat_fd);
+	if (steady && !warmup_done)
+		fprintf(stderr, "never reached steady state, stats include warmup\n");
+	free(steady);
+	return runtime_delta;
+}
+
+
+/*
+ * run one --slo step at rps (per message thread) and record how it went
+ */
+static struct slo_point *slo_step(struct thread_data *message_threads_mem,
+				  unsigned int rps)
+{
+	struct slo_point *p = slo_curve + nr_slo_points++;
+	struct stats wakeup_stats;
+	struct stats request_stats;
+	unsigned long long start_count;
+	unsigned long long loop_count;
+	unsigned long long loop_runtime;
+	struct timeval start;
+	struct timeval now;
+
+	requests_per_sec = rps;
+	sleep(SLO_SETTLE_SEC);
+	reset_thread_stats(message_threads_mem);
+	combine_message_thread_rps(message_threads_mem, &start_count);
+	gettimeofday(&start, NULL);
+
+	sleep(slo_step_sec - SLO_SETTLE_SEC);
+
+	gettimeofday(&now, NULL);
+	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
+	memset(&request_stats, 0, sizeof(request_stats));
+	combine_message_thread_stats(&wakeup_stats, &request_stats,
+				     message_threads_mem, &loop_count,
+				     &loop_runtime);
+	combine_message_thread_rps(message_threads_mem, &loop_count);
+
+	p->rps = rps * message_threads;
+	p->achieved = (double)(loop_count - start_count) * USEC_PER_SEC /
+		tvdelta(&start, &now);
+	p->latency = stats_percentile(&request_stats, slo_pct);
+	p->pass = p->latency <= slo_usec &&
+		p->achieved >= p->rps * SLO_MIN_ACHIEVED;
+
+	fprintf(stderr, "slo step %d: rps %u achieved %.2f p%.1f %u usec %s\n",
+		nr_slo_points, p->rps, p->achieved, slo_pct, p->latency,
+		p->pass ? "pass" : "fail");
+	return p;
+}
+
+/*
+ * --slo replaces sleep_for_runtime().  RPS doubles from -R until a step
+ * misses the SLO, and then we binary search between the best passing
+ * step and the lowest failing one
+ */
+static void run_slo_search(struct thread_data *message_threads_mem)
+{
+	unsigned int rps = requests_per_sec;
+	unsigned int lo = 0;
+	unsigned int hi = 0;
+	struct slo_point *p;
+
+	fprintf(stderr, "searching for max rps with p%.1f request latency <= %u usec\n",
+		slo_pct, slo_usec);
+	while (nr_slo_points < SLO_MAX_STEPS) {
+		p = slo_step(message_threads_mem, rps);
+		if (p->pass) {
+			lo = rps;
+			slo_knee = p - slo_curve;
+		} else {
+			hi = rps;
+		}
+
+		if (!hi) {
+			/* don't overflow the dispatcher */
+			if (rps >= (1U << 30))
+				break;
+			rps *= 2;
+			continue;
+		}
+		if (hi - lo <= 1 || hi - lo <= hi * SLO_PRECISION)
+			break;
+		rps = lo + (hi - lo) / 2;
+	}
+
+	if (slo_knee >= 0) {
+		p = slo_curve + slo_knee;
+		fprintf(stderr, "slo knee: %u rps (achieved %.2f) p%.1f %u usec\n",
+			p->rps, p->achieved, slo_pct, p->latency);
+	} else {
+		fprintf(stderr, "slo search: no rps met p%.1f <= %u usec\n",
+			slo_pct, slo_usec);
+	}
+}
+
+/* set up thread_attr for --stack-size, otherwise it's just the defaults */
+static void init_thread_attr(void)
+{
+	size_t size = stack_size_kb * 1024;
+	int ret;
+
+	ret = pthread_attr_init(&thread_attr);
+	if (ret) {
+		fprintf(stderr, "error %d from pthread_attr_init\n", ret);
+		exit(1);
+	}
+	if (!stack_size_kb)
+		return;
+
+	if (size < (size_t)PTHREAD_STACK_MIN)
+		size = PTHREAD_STACK_MIN;
+	ret = pthread_attr_setstacksize(&thread_attr, size);
+	if (ret) {
+		fprintf(stderr, "error %d setting stack size to %lu KB\n", ret,
+			stack_size_kb);
+		exit(1);
+	}
+}
+
+/*
+ * start the message threads, each one starts its own workers and
+ * dispatchers, along with the wake helpers and the -A controller.
+ * Returns how long it took everyone to reach the start barrier
+ */
+static unsigned long long start_threads(struct thread_data *message_threads_mem,
+					struct rps_controller *rps_ctl,
+					pthread_t *auto_rps_tid)
+{
+	unsigned long long start_ns;
+	int i;
+	int ret;
+
+	stopping = 0;
+	if (wake_helpers) {
+		for (i = 0; i < nr_llc; i++) {
+			wake_helpers[i].index = i;
+			ret = pthread_create(&wake_helpers[i].tid, &thread_attr,
+					     wake_helper_thread, wake_helpers + i);
+			if (ret) {
+				fprintf(stderr, "error %d from pthread_create\n", ret);
+				exit(1);
+			}
+		}
+	}
+
+	start_ns = nsec_now();
+	for (i = 0; i < message_threads; i++) {
+		pthread_t tid;
+		int index = i * worker_threads + i;
+		struct thread_data *td = message_threads_mem + index;
+		td->index = i;
+		ret = pthread_create(&tid, &thread_attr, message_thread,
+				     message_threads_mem + index);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+		message_threads_mem[index].tid = tid;
+	}
+	pthread_barrier_wait(&start_barrier);
+	start_ns = nsec_now() - start_ns;
+
+	memset(rps_ctl, 0, sizeof(*rps_ctl));
+	auto_rps_target_hit = 0;
+	if (auto_rps) {
+		ret = pthread_create(auto_rps_tid, &thread_attr, auto_rps_thread,
+				     rps_ctl);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+	if (phases) {
+		ret = pthread_create(&phase_tid, &thread_attr, phase_thread,
+				     message_threads_mem);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+	if (burst_period) {
+		ret = pthread_create(&burst_tid, &thread_attr, burst_thread,
+				     message_threads_mem);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+	if (churn_period) {
+		ret = pthread_create(&churn_tid, &thread_attr, churn_thread,
+				     message_threads_mem);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+	start_antagonists();
+	return start_ns;
+}
+
+/* tell everyone to stop and wait for them to exit */
+static void stop_threads(struct thread_data *message_threads_mem,
+			 pthread_t auto_rps_tid)
+{
+	int i;
+
 	__sync_synchronize();
 	stopping = 1;
+	if (auto_rps)
+		pthread_join(auto_rps_tid, NULL);
+
+	for (i = 0; i < message_threads; i++) {
+		int index = i * worker_threads + i;
+		fpost(&message_threads_mem[index].futex);
+		pthread_join(message_threads_mem[index].tid, NULL);
+	}
+	if (wake_helpers) {
+		for (i = 0; i < nr_llc; i++) {
+			fpost(&wake_helpers[i].futex);
+			pthread_join(wake_helpers[i].tid, NULL);
+		}
+	}
+	if (phases)
+		pthread_join(phase_tid, NULL);
+	if (burst_period)
+		pthread_join(burst_tid, NULL);
+	if (churn_period)
+		pthread_join(churn_tid, NULL);
+	stop_antagonists();
 }
 
+/*
+ * put everything back the way main set it up so --respawn can start the
+ * threads again.  The histograms, pipe buffers and worker footprints are
+ * kept, everything the threads wrote is thrown away
+ */
+static void reset_thread_data(struct thread_data *thread_data)
+{
+	struct thread_data *td;
+	struct thread_data save;
+	struct dispatcher dsave;
+	struct request *req;
+	int i;
+
+	for (i = 0; i < message_threads * worker_threads + message_threads; i++) {
+		td = thread_data + i;
+		if (td->schedstat_fd >= 0)
+			close(td->schedstat_fd);
+		while (td->request) {
+			req = td->request;
+			td->request = req->next;
+			free(req);
+		}
+		save = *td;
+		memset(td, 0, sizeof(*td));
+		td->index = save.index;
+		td->pin_cpus = save.pin_cpus;
+		td->data = save.data;
+		td->pipe_page = save.pipe_page;
+		td->wakeup_stats = save.wakeup_stats;
+		td->request_stats = save.request_stats;
+		td->wake_pos_stats = save.wake_pos_stats;
+		td->bw_stats = save.bw_stats;
+		td->dist_stats = save.dist_stats;
+		td->sleep_stats = save.sleep_stats;
+		td->breakdown_stats = save.breakdown_stats;
+		td->flight = save.flight;
+		td->schedstat_fd = -1;
+	}
+	for (i = 0; dispatchers && i < message_threads * nr_dispatchers; i++) {
+		dsave = dispatchers[i];
+		memset(dispatchers + i, 0, sizeof(dsave));
+		dispatchers[i].index = dsave.index;
+		dispatchers[i].workers = dsave.workers;
+		dispatchers[i].first = dsave.first;
+		dispatchers[i].nr_workers = dsave.nr_workers;
+	}
+	/* the --burst backlog is sent minus loop_count, which starts over */
+	burst_sent = 0;
+	reset_thread_stats(thread_data);
+}
 
 int main(int ac, char **av)
 {
@@ -1843,8 +7555,63 @@ int main(int ac, char **av)
 	double loops_per_sec;
 	unsigned long long loop_count;
 	unsigned long long loop_runtime;
+	struct stats wake_pos_stats[WAKE_POS_BUCKETS];
+	struct stats bw_stats;
+	struct stats dist_stats[NR_DIST];
+	struct stats breakdown_stats[NR_BREAKDOWN];
+	struct stats sleep_stats;
+	struct stats lateness_stats;
+	unsigned long long spawn_ns;
+	unsigned long long first_spawn_ns = 0;
+	int nr_threads;
+	unsigned long long reporter_start_ns;
+	unsigned long long reporter_cpu_ns = 0;
+	unsigned long long reporter_wall_ns = 0;
+	unsigned long long cpu_start_ns;
+	unsigned long long slept_usec = 0;
+	struct timespec reporter_cpu;
+	struct stats iter_wakeup;
+	struct stats iter_request;
+	struct stats merged_rps;
+	struct stats *iter_hists[NR_HIST] = { NULL };
+	unsigned long long iter_loops;
+	unsigned long long iter_loop_runtime;
+	unsigned long long iter_dropped = 0;
+	unsigned long long iter_overruns = 0;
+	struct spin_stats iter_worker_ss;
+	struct spin_stats iter_msg_ss;
+	int iter;
+	double reporter_pct;
+	unsigned long long dispatch_dropped = 0;
+	unsigned long long dispatch_overruns = 0;
+	struct spin_stats worker_ss;
+	struct spin_stats msg_ss;
+	int spinning;
+	char label[64];
+	struct rps_controller rps_ctl;
+	pthread_t auto_rps_tid;
+	double steady_abs_err = 0;
+	double steady_err = 0;
 
 	parse_options(ac, av);
+	if (phases_file)
+		read_phases();
+	if (burst_period && !requests_per_sec) {
+		fprintf(stderr, "--burst needs -R\n");
+		exit(1);
+	}
+	init_thread_attr();
+	if (nr_antagonists)
+		setup_antagonists();
+	spinning = worker_spin.ns || worker_spin.adaptive ||
+		msg_spin.ns || msg_spin.adaptive;
+
+	if (pin_policy != PIN_NONE) {
+		read_cpu_topology();
+		print_topology();
+		if (pin_policy == PIN_LLC && !message_threads_specified)
+			pin_pick_message_threads();
+	}
 
 	if (worker_threads == 0) {
 		unsigned long num_cpus = get_nprocs();
@@ -1853,6 +7620,7 @@ int main(int ac, char **av)
 
 		fprintf(stderr, "setting worker threads to %d\n", worker_threads);
 	}
+	active_workers = worker_threads;
 
 	/* Calculate matrix sizes based on split percentage */
 	if (split_specified) {
@@ -1869,11 +7637,17 @@ int main(int ac, char **av)
 
 		/* Allocate shared data if needed */
 		if (shared_matrix_size > 0) {
-			shared_data = malloc(3 * sizeof(unsigned long) * shared_matrix_size * shared_matrix_size);
+			shared_data = alloc_footprint(3 * sizeof(unsigned long) * shared_matrix_size * shared_matrix_size);
 			if (!shared_data) {
 				perror("unable to allocate shared data");
 				exit(1);
 			}
+			if (page_backing != PAGES_DEFAULT) {
+				describe_backing(shared_data, shared_backing,
+						 sizeof(shared_backing));
+				fprintf(stderr, "shared data backing: %s\n",
+					shared_backing);
+			}
 		}
 	} else {
 		/* Legacy behavior: no split, all private */
@@ -1902,46 +7676,256 @@ int main(int ac, char **av)
 	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
 	memset(&request_stats, 0, sizeof(request_stats));
 	memset(&rps_stats, 0, sizeof(rps_stats));
-
-	message_threads_mem = calloc(message_threads * worker_threads + message_threads,
-				      sizeof(struct thread_data));
+	memset(wake_pos_stats, 0, sizeof(wake_pos_stats));
+	memset(&bw_stats, 0, sizeof(bw_stats));
+	memset(dist_stats, 0, sizeof(dist_stats));
+	memset(breakdown_stats, 0, sizeof(breakdown_stats));
+	memset(&sleep_stats, 0, sizeof(sleep_stats));
+	memset(&lateness_stats, 0, sizeof(lateness_stats));
+	if (wakeup_topology)
+		read_cpu_topology();
+
+	message_threads_mem = alloc_thread_data(message_threads * worker_threads +
+						message_threads);
 
 	if (!message_threads_mem) {
 		perror("unable to allocate message threads");
 		exit(1);
 	}
 
-	/* start our message threads, each one starts its own workers */
-	for (i = 0; i < message_threads; i++) {
-		pthread_t tid;
-		int index = i * worker_threads + i;
-		struct thread_data *td = message_threads_mem + index;
-		td->index = i;
-		ret = pthread_create(&tid, NULL, message_thread,
-				     message_threads_mem + index);
-		if (ret) {
-			fprintf(stderr, "error %d from pthread_create\n", ret);
+	for (i = 0; i < message_threads * worker_threads + message_threads; i++) {
+		struct thread_data *td = message_threads_mem + i;
+
+		td->schedstat_fd = -1;
+		/* message threads don't record any histograms */
+		if (i % (worker_threads + 1) == 0)
+			continue;
+
+		td->wakeup_stats = alloc_worker_stats(2);
+		td->request_stats = td->wakeup_stats + 1;
+		if (pipe_test) {
+			td->pipe_page = malloc(pipe_test);
+			if (!td->pipe_page) {
+				perror("unable to allocate pipe buffer");
+				exit(1);
+			}
+		}
+		if (wake_mode_specified)
+			td->wake_pos_stats = alloc_worker_stats(WAKE_POS_BUCKETS);
+		if (work_kernel != KERNEL_MATRIX)
+			td->bw_stats = alloc_worker_stats(1);
+		if (wakeup_topology)
+			td->dist_stats = alloc_worker_stats(NR_DIST);
+		if (sleep_mode_specified && !pipe_test)
+			td->sleep_stats = alloc_worker_stats(1);
+		if (breakdown && !pipe_test)
+			td->breakdown_stats = alloc_worker_stats(NR_BREAKDOWN);
+		if (flight_usec) {
+			td->flight = calloc(1, sizeof(*td->flight));
+			if (!td->flight) {
+				perror("unable to allocate flight recorder");
+				exit(1);
+			}
+		}
+	}
+	if (flight_usec) {
+		flight_fp = fopen(flight_file, "w");
+		if (!flight_fp) {
+			perror("unable to open flight file");
 			exit(1);
 		}
-		message_threads_mem[index].tid = tid;
+		flight_start_ns = nsec_now();
+	}
+	if (fairness) {
+		fair_workers = calloc(message_threads * worker_threads,
+				      sizeof(*fair_workers));
+		fair_groups = calloc(message_threads, sizeof(*fair_groups));
+		if (!fair_workers || !fair_groups) {
+			perror("unable to allocate fairness stats");
+			exit(1);
+		}
+	}
+	if (requests_per_sec) {
+		if (nr_dispatchers > worker_threads) {
+			fprintf(stderr, "only %d workers per message thread, using %d dispatchers\n",
+				worker_threads, worker_threads);
+			nr_dispatchers = worker_threads;
+		}
+		dispatchers = calloc(message_threads * nr_dispatchers,
+				     sizeof(struct dispatcher));
+		if (!dispatchers) {
+			perror("unable to allocate dispatchers");
+			exit(1);
+		}
+		/* split each group's workers as evenly as we can */
+		for (i = 0; i < message_threads * nr_dispatchers; i++) {
+			struct dispatcher *d = dispatchers + i;
+			int group = i / nr_dispatchers;
+			int n = i % nr_dispatchers;
+
+			d->index = i;
+			d->first = n * worker_threads / nr_dispatchers;
+			d->nr_workers = (n + 1) * worker_threads / nr_dispatchers -
+				d->first;
+			d->workers = message_threads_mem +
+				group * worker_threads + group + 1 + d->first;
+		}
 	}
 
-	sleep_for_runtime(message_threads_mem);
+	if (pin_policy != PIN_NONE)
+		apply_pin_policy(message_threads_mem);
 
-	for (i = 0; i < message_threads; i++) {
-		int index = i * worker_threads + i;
-		fpost(&message_threads_mem[index].futex);
-		pthread_join(message_threads_mem[index].tid, NULL);
+	if (wake_mode == WAKE_HELPER && !requests_per_sec) {
+		read_cpu_topology();
+		wake_helpers = alloc_thread_data(nr_llc);
+		if (!wake_helpers) {
+			perror("unable to allocate wake helpers");
+			exit(1);
+		}
+		fprintf(stderr, "starting %d wake helper threads\n", nr_llc);
 	}
-	memset(&wakeup_stats, 0, sizeof(wakeup_stats));
-	memset(&request_stats, 0, sizeof(request_stats));
-	combine_message_thread_stats(&wakeup_stats, &request_stats,
-				     message_threads_mem,
-				     &loop_count, &loop_runtime);
+
+	nr_threads = message_threads * worker_threads + message_threads;
+	if (requests_per_sec)
+		nr_threads += message_threads * (nr_dispatchers - 1);
+	/* + 1 for us */
+	ret = pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+	if (ret) {
+		fprintf(stderr, "error %d from pthread_barrier_init\n", ret);
+		exit(1);
+	}
+	if (metrics_socket)
+		start_metrics_server();
+	if (auto_rps && auto_rps_cpus && !worker_cpus)
+		fprintf(stderr, "--auto-rps-cpus without -W, using all cpus\n");
+	if (iterations > 1) {
+		iter_vals = calloc(iterations * NR_HIST * NR_BASELINE_PCT,
+				   sizeof(*iter_vals));
+		if (!iter_vals) {
+			perror("unable to allocate iteration results");
+			exit(1);
+		}
+	}
+	iter_hists[HIST_WAKEUP] = &iter_wakeup;
+	if (!pipe_test) {
+		iter_hists[HIST_REQUEST] = &iter_request;
+		iter_hists[HIST_RPS] = &rps_stats;
+	}
+
+	/*
+	 * every iteration's histograms are merged into the totals.  Without
+	 * --respawn the threads keep running, so the loop and dispatch
+	 * counters are already totals by the last iteration
+	 */
+	memset(&merged_rps, 0, sizeof(merged_rps));
+	memset(&worker_ss, 0, sizeof(worker_ss));
+	memset(&msg_ss, 0, sizeof(msg_ss));
+	loop_count = 0;
+	loop_runtime = 0;
+	for (iter = 0; iter < iterations; iter++) {
+		int last = iter == iterations - 1;
+
+		if (iter == 0 || respawn) {
+			if (iter)
+				reset_thread_data(message_threads_mem);
+			spawn_ns = start_threads(message_threads_mem, &rps_ctl,
+						 &auto_rps_tid);
+			fprintf(stderr, "spawned %d threads in %.2f ms\n",
+				nr_threads, (double)spawn_ns / 1000000);
+			if (iter == 0)
+				first_spawn_ns = spawn_ns;
+		}
+		if (iterations > 1)
+			fprintf(stderr, "iteration %d of %d\n", iter + 1,
+				iterations);
+
+		/* the reporter runs in this thread, track what it costs us */
+		reporter_start_ns = nsec_now();
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &reporter_cpu);
+		cpu_start_ns = reporter_cpu.tv_sec * NSEC_PER_SEC +
+			reporter_cpu.tv_nsec;
+
+		if (slo_usec)
+			run_slo_search(message_threads_mem);
+		else
+			slept_usec += sleep_for_runtime(message_threads_mem,
+							iter && !respawn);
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &reporter_cpu);
+		reporter_cpu_ns += reporter_cpu.tv_sec * NSEC_PER_SEC +
+			reporter_cpu.tv_nsec - cpu_start_ns;
+		reporter_wall_ns += nsec_now() - reporter_start_ns;
+
+		if (respawn || last) {
+			stop_threads(message_threads_mem, auto_rps_tid);
+			if (auto_rps && rps_ctl.steady_samples) {
+				steady_abs_err = rps_ctl.steady_abs_err / rps_ctl.steady_samples;
+				steady_err = rps_ctl.steady_err / rps_ctl.steady_samples;
+			}
+		}
+
+		memset(&iter_wakeup, 0, sizeof(iter_wakeup));
+		memset(&iter_request, 0, sizeof(iter_request));
+		combine_message_thread_stats(&iter_wakeup, &iter_request,
+					     message_threads_mem,
+					     &iter_loops, &iter_loop_runtime);
+		combine_stats(&wakeup_stats, &iter_wakeup);
+		combine_stats(&request_stats, &iter_request);
+		combine_stats(&merged_rps, &rps_stats);
+		if (iter_vals)
+			record_iteration(iter, iter_hists);
+		if (fairness)
+			record_fairness(message_threads_mem, respawn || last);
+
+		if (wake_mode_specified && !requests_per_sec)
+			combine_worker_stats(wake_pos_stats, WORKER_WAKE_POS,
+					     message_threads_mem);
+		if (work_kernel != KERNEL_MATRIX)
+			combine_worker_stats(&bw_stats, WORKER_BW,
+					     message_threads_mem);
+		if (wakeup_topology)
+			combine_worker_stats(dist_stats, WORKER_DIST,
+					     message_threads_mem);
+		combine_worker_stats(&sleep_stats, WORKER_SLEEP,
+				     message_threads_mem);
+		if (breakdown)
+			combine_worker_stats(breakdown_stats, WORKER_BREAKDOWN,
+					     message_threads_mem);
+		combine_spin_stats(message_threads_mem, &iter_worker_ss,
+				   &iter_msg_ss);
+		add_spin_stats(&worker_ss, &iter_worker_ss);
+		add_spin_stats(&msg_ss, &iter_msg_ss);
+		if (dispatchers)
+			combine_dispatcher_stats(&lateness_stats, &iter_dropped,
+						 &iter_overruns);
+		if (respawn || last) {
+			loop_count += iter_loops;
+			loop_runtime += iter_loop_runtime;
+			dispatch_dropped += iter_dropped;
+			dispatch_overruns += iter_overruns;
+		}
+	}
+	rps_stats = merged_rps;
+	if (dispatchers)
+		report_dispatchers = dispatch_worth_reporting(dispatch_dropped,
+							      dispatch_overruns,
+							      busiest_dispatcher_total());
+	reporter_pct = (double)reporter_cpu_ns * 100 / reporter_wall_ns;
+	/* --measure and --iterations change how long we really ran */
+	if (iterations > 1 || (steady_usec && measure_sec))
+		runtime = (slept_usec + USEC_PER_SEC / 2) / USEC_PER_SEC;
 
 	loops_per_sec = loop_count * USEC_PER_SEC;
 	loops_per_sec /= loop_runtime;
 
+	json_hists[HIST_WAKEUP] = &wakeup_stats;
+	if (!pipe_test) {
+		json_hists[HIST_REQUEST] = &request_stats;
+		json_hists[HIST_RPS] = &rps_stats;
+	}
+	if (baseline_file)
+		compare_baseline();
+
 	if (json_file) {
 		FILE *outfile;
 
@@ -1962,8 +7946,87 @@ int main(int ac, char **av)
 			fprintf(outfile, ", ");
 			write_json_stats(outfile, &rps_stats,
 					 "rps");
+			if (work_kernel != KERNEL_MATRIX) {
+				fprintf(outfile, ", ");
+				write_json_stats(outfile, &bw_stats,
+						 "request_bandwidth_mbs");
+			}
+			if (sleep_stats.nr_samples) {
+				fprintf(outfile, ", ");
+				write_json_stats(outfile, &sleep_stats,
+						 "oversleep");
+			}
+			if (lateness_stats.nr_samples) {
+				fprintf(outfile, ", ");
+				write_json_stats(outfile, &lateness_stats,
+						 "dispatch_lateness");
+			}
+			if (report_dispatchers) {
+				fprintf(outfile, ", \"dispatch_dropped\": %llu",
+					dispatch_dropped);
+				fprintf(outfile, ", \"dispatch_overruns\": %llu",
+					dispatch_overruns);
+			}
+		}
+		for (i = 0; i < WAKE_POS_BUCKETS; i++) {
+			if (!wake_pos_stats[i].nr_samples)
+				continue;
+			snprintf(label, sizeof(label), "wakeup_latency_pos%d", i);
+			fprintf(outfile, ", ");
+			write_json_stats(outfile, wake_pos_stats + i, label);
+		}
+		for (i = 0; i < NR_DIST; i++) {
+			if (!dist_stats[i].nr_samples)
+				continue;
+			snprintf(label, sizeof(label), "wakeup_latency_%s",
+				 dist_json_names[i]);
+			fprintf(outfile, ", ");
+			write_json_stats(outfile, dist_stats + i, label);
+		}
+		for (i = 0; i < NR_BREAKDOWN; i++) {
+			if (!breakdown_stats[i].nr_samples)
+				continue;
+			snprintf(label, sizeof(label), "request_latency_%s",
+				 breakdown_json_names[i]);
+			fprintf(outfile, ", ");
+			write_json_stats(outfile, breakdown_stats + i, label);
+		}
+		if (spinning) {
+			write_json_spin_stats(outfile, &worker_ss, "worker");
+			write_json_spin_stats(outfile, &msg_ss, "msg");
 		}
 		fprintf(outfile, ", \"runtime\": %u", runtime);
+		if (page_backing != PAGES_DEFAULT)
+			fprintf(outfile, ", \"hugetlb_fallbacks\": %lu",
+				hugetlb_fallbacks);
+		if (auto_warmup)
+			fprintf(outfile, ", \"steady_state_sec\": %.1f",
+				(double)steady_usec / USEC_PER_SEC);
+		fprintf(outfile, ", \"spawn_ms\": %.2f",
+			(double)first_spawn_ns / 1000000);
+		fprintf(outfile, ", \"reporter_cpu_ms\": %.2f",
+			(double)reporter_cpu_ns / 1000000);
+		fprintf(outfile, ", \"reporter_cpu_pct\": %.3f", reporter_pct);
+		if (slo_knee >= 0) {
+			fprintf(outfile, ", \"slo_knee_rps\": %u",
+				slo_curve[slo_knee].rps);
+			fprintf(outfile, ", \"slo_knee_latency\": %u",
+				slo_curve[slo_knee].latency);
+		}
+		if (auto_rps) {
+			fprintf(outfile, ", \"auto_rps_final\": %d",
+				requests_per_sec * message_threads);
+			fprintf(outfile, ", \"auto_rps_samples\": %lu",
+				rps_ctl.samples);
+			if (rps_ctl.converged_ns) {
+				fprintf(outfile, ", \"auto_rps_converge_sec\": %.3f",
+					(double)rps_ctl.converged_ns / NSEC_PER_SEC);
+				fprintf(outfile, ", \"auto_rps_steady_abs_error\": %.2f",
+					steady_abs_err);
+				fprintf(outfile, ", \"auto_rps_steady_error\": %.2f",
+					steady_err);
+			}
+		}
 		write_json_footer(outfile);
 		if (outfile != stdout)
 			fclose(outfile);
@@ -1975,17 +8038,37 @@ int main(int ac, char **av)
 
 		show_latencies(&wakeup_stats, "Wakeup Latencies", "usec", runtime,
 			       PLIST_20 | PLIST_FOR_LAT, PLIST_99);
+		show_wake_pos_latencies(wake_pos_stats, runtime);
+		show_dist_latencies(dist_stats, runtime);
 
 		mb_per_sec = (loop_count * pipe_test * USEC_PER_SEC) / loop_runtime;
 		mb_per_sec = pretty_size(mb_per_sec, &pretty);
 		fprintf(stderr, "avg worker transfer: %.2f ops/sec %.2f%s/s\n",
 		       loops_per_sec, mb_per_sec, pretty);
+		if (spinning) {
+			show_spin_stats("worker", &worker_ss);
+			show_spin_stats("message", &msg_ss);
+		}
 	} else {
 		unsigned long long message_thread_delay, worker_thread_delay;
 		show_latencies(&wakeup_stats, "Wakeup Latencies", "usec",
 			       runtime, PLIST_FOR_LAT, PLIST_99);
+		show_wake_pos_latencies(wake_pos_stats, runtime);
+		show_dist_latencies(dist_stats, runtime);
 		show_latencies(&request_stats, "Request Latencies", "usec",
 			       runtime, PLIST_FOR_LAT, PLIST_99);
+		show_breakdown_latencies(breakdown_stats, runtime);
+		if (work_kernel != KERNEL_MATRIX)
+			show_latencies(&bw_stats, "Request Bandwidth", "MB/s",
+				       runtime, PLIST_FOR_RPS, PLIST_50);
+		if (sleep_stats.nr_samples)
+			show_latencies(&sleep_stats, "Oversleep Latencies",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+		if (lateness_stats.nr_samples)
+			show_latencies(&lateness_stats, "Dispatch Lateness",
+				       "usec", runtime, PLIST_FOR_LAT, PLIST_99);
+		if (report_dispatchers)
+			show_dispatchers();
 		show_latencies(&rps_stats, "RPS", "requests", runtime,
 			       PLIST_FOR_RPS, PLIST_50);
 		if (!auto_rps) {
@@ -1994,6 +8077,13 @@ int main(int ac, char **av)
 		} else {
 			fprintf(stderr, "final rps goal was %d\n",
 				requests_per_sec * message_threads);
+			if (rps_ctl.converged_ns)
+				fprintf(stderr, "auto rps converged in %.2fs, steady state error %.2f%% (mean abs %.2f%%)\n",
+					(double)rps_ctl.converged_ns / NSEC_PER_SEC,
+					steady_err, steady_abs_err);
+			else
+				fprintf(stderr, "auto rps did not converge in %lu samples\n",
+					rps_ctl.samples);
 		}
 		collect_sched_delay(message_threads_mem, &message_thread_delay,
 				    &worker_thread_delay);
@@ -2002,9 +8092,43 @@ int main(int ac, char **av)
 			"sched delay: message %llu (usec) worker %llu (usec)\n",
 			message_thread_delay / 1000,
 			worker_thread_delay / 1000);
+		if (spinning) {
+			show_spin_stats("worker", &worker_ss);
+			show_spin_stats("message", &msg_ss);
+		}
+	}
+	if (iterations > 1)
+		show_iterations();
+	if (phases)
+		show_phases();
+	if (burst_period)
+		show_recovery(&burst_recovery);
+	if (churn_period)
+		show_recovery(&churn_recovery);
+	if (nr_antagonists)
+		show_antagonists();
+	if (fairness)
+		show_fairness();
+	if (flight_fp) {
+		flush_flight_dumps();
+		fclose(flight_fp);
+		fprintf(stderr, "flight recorder: %lu slow events written to %s, %lu more dropped\n",
+			flight_dumps, flight_file, flight_dropped);
 	}
+	if (reporter_pct >= REPORTER_WARN_PCT)
+		fprintf(stderr, "reporter cpu: %.2f ms (%.3f%% of a cpu)\n",
+			(double)reporter_cpu_ns / 1000000, reporter_pct);
+	if (baseline_file)
+		show_baseline();
 	free(message_threads_mem);
-	if (shared_data)
+	if (metrics_socket)
+		unlink_metrics_socket();
+	if (hugetlb_fallbacks)
+		fprintf(stderr, "%lu MAP_HUGETLB allocations fell back to normal pages\n",
+			hugetlb_fallbacks);
+
+	/* the other --hugepages types are mmaped, let exit clean them up */
+	if (shared_data && page_backing == PAGES_DEFAULT)
 		free(shared_data);
 
 	return 0;